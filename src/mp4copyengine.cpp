@@ -0,0 +1,625 @@
+#include "mp4copyengine.h"
+#include "mp4uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+#define COPY_CHUNK_SIZE     ((off_t)64 << 20) // per kernel call
+#define COPY_BUFFER_SIZE    (1 << 20)
+#define COPY_BUFFER_ALIGN   4096
+#define COPY_PIECE_SIZE     ((off_t)8 << 20) // unit of work of a parallel copy
+#define URING_SLOT_SIZE     ((off_t)1 << 20) // one read then one write per slot
+#define PACE_STEP_SIZE      ((off_t)8 << 20) // written back and dropped at once
+
+// the result of a path that is not done: 1 to try the next one
+#define COPY_UNSUPPORTED    1
+
+const char*
+CopyPathName(CopyPath path)
+{
+    switch (path) {
+    case COPY_PATH_COPY_FILE_RANGE: return "copy_file_range";
+    case COPY_PATH_SENDFILE:        return "sendfile";
+    case COPY_PATH_SPLICE:          return "splice";
+    case COPY_PATH_BUFFER:          return "buffer";
+    case COPY_PATH_REFLINK:         return "reflink";
+    case COPY_PATH_IO_URING:        return "io_uring";
+    default:                        return "none";
+    }
+}
+
+#ifdef __linux__
+// errors that only mean this path does not work for this pair of files
+static int
+Unsupported(int err)
+{
+    if (err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == EBADF) {
+        return COPY_UNSUPPORTED;
+    }
+    return -1;
+}
+#endif
+
+static int
+CopyWithCopyFileRange(int srcFD, off_t *offset, int dstFD, off_t *left)
+{
+#if defined(__linux__) && defined(__NR_copy_file_range)
+    while (*left > 0) {
+        loff_t in = *offset;
+        ssize_t n = syscall(__NR_copy_file_range, srcFD, &in, dstFD, NULL, (size_t)min(*left, COPY_CHUNK_SIZE), 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return Unsupported(errno);
+        }
+        if (n == 0) {
+            // some filesystems report 0 instead of failing, let the
+            // buffer path tell a short source from that
+            return COPY_UNSUPPORTED;
+        }
+        *offset += n;
+        *left -= n;
+    }
+    return 0;
+#else
+    return COPY_UNSUPPORTED;
+#endif
+}
+
+static int
+CopyWithSendfile(int srcFD, off_t *offset, int dstFD, off_t *left)
+{
+#ifdef __linux__
+    while (*left > 0) {
+        ssize_t n = sendfile(dstFD, srcFD, offset, (size_t)min(*left, COPY_CHUNK_SIZE));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return Unsupported(errno);
+        }
+        if (n == 0) {
+            return COPY_UNSUPPORTED;
+        }
+        *left -= n;
+    }
+    return 0;
+#else
+    return COPY_UNSUPPORTED;
+#endif
+}
+
+static int
+CopyWithSplice(int srcFD, off_t *offset, int dstFD, off_t *left)
+{
+#ifdef __linux__
+    int pipeFD[2];
+    if (pipe(pipeFD) != 0) {
+        return COPY_UNSUPPORTED;
+    }
+
+    int ret = 0;
+    while (*left > 0) {
+        loff_t in = *offset;
+        ssize_t n = splice(srcFD, &in, pipeFD[1], NULL, (size_t)min(*left, COPY_CHUNK_SIZE), SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ret = n < 0 ? Unsupported(errno) : COPY_UNSUPPORTED;
+            break;
+        }
+
+        // whatever made it into the pipe has to reach dstFD, the source
+        // side is only moved on after that
+        ssize_t drained = 0;
+        while (drained < n) {
+            ssize_t m = splice(pipeFD[0], NULL, dstFD, NULL, n - drained, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                break;
+            }
+            drained += m;
+        }
+        if (drained < n) {
+            // the pipe is dropped, so is the rest; the next path takes over
+            // from the last byte that reached dstFD
+            *offset += drained;
+            *left -= drained;
+            ret = COPY_UNSUPPORTED;
+            break;
+        }
+        *offset += n;
+        *left -= n;
+    }
+
+    ::close(pipeFD[0]);
+    ::close(pipeFD[1]);
+    return ret;
+#else
+    return COPY_UNSUPPORTED;
+#endif
+}
+
+static int
+CopyWithBuffer(int srcFD, off_t *offset, int dstFD, off_t *left)
+{
+    void *buff = NULL;
+    if (posix_memalign(&buff, COPY_BUFFER_ALIGN, COPY_BUFFER_SIZE) != 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    while (*left > 0 && ret == 0) {
+        ssize_t r = pread(srcFD, buff, (size_t)min(*left, (off_t)COPY_BUFFER_SIZE), *offset);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            ret = -1;
+            break;
+        }
+
+        ssize_t written = 0;
+        while (written < r) {
+            ssize_t w = ::write(dstFD, (char *)buff + written, r - written);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                ret = -1;
+                break;
+            }
+            written += w;
+        }
+        *offset += written;
+        *left -= written;
+    }
+
+    free(buff);
+    return ret;
+}
+
+int
+CopyFileData(int srcFD, off_t srcOffset, int dstFD, off_t size, CopyPath *path)
+{
+    typedef int (*CopyFunc)(int, off_t*, int, off_t*);
+    static const struct
+    {
+        CopyPath path;
+        CopyFunc func;
+    } engines[] = {
+        { COPY_PATH_COPY_FILE_RANGE,    CopyWithCopyFileRange },
+        { COPY_PATH_SENDFILE,           CopyWithSendfile },
+        { COPY_PATH_SPLICE,             CopyWithSplice },
+        { COPY_PATH_BUFFER,             CopyWithBuffer },
+    };
+
+    *path = COPY_PATH_NONE;
+    if (size <= 0) {
+        return 0;
+    }
+
+    off_t offset = srcOffset;
+    off_t left = size;
+    int ret = -1;
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        *path = engines[i].path;
+        ret = engines[i].func(srcFD, &offset, dstFD, &left);
+        if (ret != COPY_UNSUPPORTED) {
+            break;
+        }
+    }
+
+    return ret == 0 ? 0 : -1;
+}
+
+int
+CloneFileData(int srcFD, off_t srcOffset, int dstFD, off_t dstOffset, off_t size, off_t blockSize, CopyPath *path)
+{
+    if (blockSize <= 0 || (srcOffset - dstOffset) % blockSize != 0) {
+        return CopyFileData(srcFD, srcOffset, dstFD, size, path);
+    }
+
+    off_t head = min(size, (blockSize - srcOffset % blockSize) % blockSize);
+    off_t body = (size - head) / blockSize * blockSize;
+    off_t tail = size - head - body;
+    if (body == 0) {
+        return CopyFileData(srcFD, srcOffset, dstFD, size, path);
+    }
+
+    CopyPath partPath;
+    if (CopyFileData(srcFD, srcOffset, dstFD, head, &partPath) != 0) {
+        *path = partPath;
+        return -1;
+    }
+
+    bool cloned = false;
+#if defined(__linux__) && defined(FICLONERANGE)
+    struct file_clone_range range;
+    range.src_fd = srcFD;
+    range.src_offset = srcOffset + head;
+    range.src_length = body;
+    range.dest_offset = dstOffset + head;
+    // the ioctl leaves the file position alone
+    cloned = ioctl(dstFD, FICLONERANGE, &range) == 0
+        && lseek(dstFD, dstOffset + head + body, SEEK_SET) == dstOffset + head + body;
+#endif
+
+    if (!cloned && CopyFileData(srcFD, srcOffset + head, dstFD, body, &partPath) != 0) {
+        *path = partPath;
+        return -1;
+    }
+    *path = cloned ? COPY_PATH_REFLINK : partPath;
+
+    return CopyFileData(srcFD, srcOffset + head + body, dstFD, tail, &partPath);
+}
+
+#ifdef __linux__
+// wait for an earlier step to reach the disk, then let its pages go; the
+// cache is only advice, failures (a pipe, say) are fine to ignore
+static void
+DropWrittenStep(int dstFD, off_t offset, off_t size)
+{
+    sync_file_range(dstFD, offset, size,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(dstFD, offset, size, POSIX_FADV_DONTNEED);
+}
+#endif
+
+int
+CopyFileDataPaced(int srcFD, off_t srcOffset, int dstFD, off_t dstOffset, off_t size, CopyPath *path)
+{
+#ifdef __linux__
+    // the source is read once, front to back
+    posix_fadvise(srcFD, srcOffset, size, POSIX_FADV_SEQUENTIAL);
+
+    *path = COPY_PATH_NONE;
+    off_t done = 0;
+    off_t previous = 0;
+    while (done < size) {
+        off_t step = min(PACE_STEP_SIZE, size - done);
+        if (CopyFileData(srcFD, srcOffset + done, dstFD, step, path) != 0) {
+            return -1;
+        }
+        posix_fadvise(srcFD, srcOffset + done, step, POSIX_FADV_DONTNEED);
+        sync_file_range(dstFD, dstOffset + done, step, SYNC_FILE_RANGE_WRITE);
+
+        if (done > 0) {
+            DropWrittenStep(dstFD, dstOffset + previous, done - previous);
+        }
+        previous = done;
+        done += step;
+    }
+    if (size > 0) {
+        DropWrittenStep(dstFD, dstOffset + previous, done - previous);
+    }
+
+    return 0;
+#else
+    (void)dstOffset;
+    return CopyFileData(srcFD, srcOffset, dstFD, size, path);
+#endif
+}
+
+// one piece at its final offset; *path falls from copy_file_range to the
+// buffer for good once the former is refused
+static int
+CopyPiece(const CopyRange& piece, int dstFD, void *buff, size_t buffSize, CopyPath *path)
+{
+    off_t srcOffset = piece.srcOffset;
+    off_t dstOffset = piece.dstOffset;
+    off_t left = piece.size;
+
+#if defined(__linux__) && defined(__NR_copy_file_range)
+    while (left > 0 && *path == COPY_PATH_COPY_FILE_RANGE) {
+        loff_t in = srcOffset;
+        loff_t out = dstOffset;
+        ssize_t n = syscall(__NR_copy_file_range, piece.srcFD, &in, dstFD, &out, (size_t)left, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && Unsupported(errno) != COPY_UNSUPPORTED) {
+            return -1;
+        }
+        if (n <= 0) {
+            *path = COPY_PATH_BUFFER;
+            break;
+        }
+        srcOffset += n;
+        dstOffset += n;
+        left -= n;
+    }
+#else
+    *path = COPY_PATH_BUFFER;
+#endif
+
+    while (left > 0) {
+        ssize_t r = pread(piece.srcFD, buff, (size_t)min(left, (off_t)buffSize), srcOffset);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        for (ssize_t written = 0; written < r; ) {
+            ssize_t w = pwrite(dstFD, (char *)buff + written, r - written, dstOffset + written);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                return -1;
+            }
+            written += w;
+        }
+        srcOffset += r;
+        dstOffset += r;
+        left -= r;
+    }
+    return 0;
+}
+
+int
+CopyFileRangesParallel(const vector<CopyRange>& ranges, int dstFD, int threads, off_t maxInFlightBytes, CopyPath *path)
+{
+    off_t pieceSize = COPY_PIECE_SIZE;
+    if (maxInFlightBytes > 0) {
+        pieceSize = max(min(pieceSize, maxInFlightBytes), (off_t)COPY_BUFFER_ALIGN);
+    }
+
+    vector<CopyRange> pieces;
+    for (vector<CopyRange>::const_iterator it = ranges.begin(); it != ranges.end(); ++it) {
+        for (off_t done = 0; done < it->size; done += pieceSize) {
+            CopyRange piece = { it->srcFD, it->srcOffset + done, it->dstOffset + done, min(pieceSize, it->size - done) };
+            pieces.push_back(piece);
+        }
+    }
+
+    *path = COPY_PATH_NONE;
+    if (pieces.empty()) {
+        return 0;
+    }
+
+    mutex lock;
+    condition_variable slotFreed;
+    size_t next = 0;
+    off_t inFlight = 0;
+    bool failed = false;
+    CopyPath slowest = COPY_PATH_COPY_FILE_RANGE;
+
+    auto worker = [&]() {
+        void *buff = NULL;
+        if (posix_memalign(&buff, COPY_BUFFER_ALIGN, pieceSize) != 0) {
+            unique_lock<mutex> guard(lock);
+            failed = true;
+            return;
+        }
+
+        CopyPath workerPath = COPY_PATH_COPY_FILE_RANGE;
+        for (;;) {
+            size_t index;
+            {
+                unique_lock<mutex> guard(lock);
+                // a piece always fits when nothing else is in flight
+                slotFreed.wait(guard, [&]() {
+                    return failed || next == pieces.size() || maxInFlightBytes <= 0
+                        || inFlight == 0 || inFlight + pieces[next].size <= maxInFlightBytes;
+                });
+                if (failed || next == pieces.size()) {
+                    break;
+                }
+                index = next++;
+                inFlight += pieces[index].size;
+            }
+
+            int ret = CopyPiece(pieces[index], dstFD, buff, pieceSize, &workerPath);
+
+            {
+                unique_lock<mutex> guard(lock);
+                inFlight -= pieces[index].size;
+                failed = failed || ret != 0;
+            }
+            slotFreed.notify_all();
+        }
+
+        unique_lock<mutex> guard(lock);
+        slowest = max(slowest, workerPath);
+        free(buff);
+    };
+
+    int count = max(1, min(threads, (int)pieces.size()));
+    vector<thread> workers;
+    for (int i = 1; i < count; ++i) {
+        workers.push_back(thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+
+    *path = slowest;
+    return failed ? -1 : 0;
+}
+
+struct UringSlot
+{
+    unsigned file;
+    off_t srcOffset;
+    off_t dstOffset;
+    off_t size;
+    off_t done;     // of the current phase
+    bool writing;
+};
+
+// (re)queue whatever is left of the slot's current phase
+static bool
+QueueSlot(IOUring& ring, const UringSlot& slot, unsigned index, uint8_t *buff)
+{
+    uint8_t *p = buff + index * URING_SLOT_SIZE + slot.done;
+    unsigned len = slot.size - slot.done;
+    if (slot.writing) {
+        return ring.prepWrite(0, p, len, slot.dstOffset + slot.done, index, index);
+    }
+    return ring.prepRead(slot.file, p, len, slot.srcOffset + slot.done, index, index);
+}
+
+/*
+ * Once a request fails nothing more is queued, but every request already
+ * in flight is reaped before returning: the kernel may still read into
+ * buff until its completion is out. Only when the ring stops taking waits
+ * with requests in flight is *drained false, and buff must not be reused.
+ */
+static int
+RunUringCopy(const vector<CopyRange>& ranges, int dstFD, unsigned slots, uint8_t *buff, bool *drained)
+{
+    *drained = true;
+
+    IOUring ring;
+    if (!ring.init(slots)) {
+        return COPY_UNSUPPORTED;
+    }
+
+    // file 0 is the output, then every source once
+    vector<int> files(1, dstFD);
+    vector<unsigned> rangeFile;
+    for (vector<CopyRange>::const_iterator it = ranges.begin(); it != ranges.end(); ++it) {
+        vector<int>::iterator f = find(files.begin(), files.end(), it->srcFD);
+        rangeFile.push_back(f - files.begin());
+        if (f == files.end()) {
+            files.push_back(it->srcFD);
+        }
+    }
+    ring.registerFiles(&files[0], files.size());
+
+    vector<struct iovec> iov(slots);
+    for (unsigned i = 0; i < slots; ++i) {
+        iov[i].iov_base = buff + i * URING_SLOT_SIZE;
+        iov[i].iov_len = URING_SLOT_SIZE;
+    }
+    ring.registerBuffers(&iov[0], slots);
+
+    vector<UringSlot> slot(slots);
+    vector<unsigned> idle;
+    for (unsigned i = slots; i > 0; --i) {
+        idle.push_back(i - 1);
+    }
+
+    size_t range = 0;
+    off_t rangeDone = 0;
+    unsigned active = 0;
+    bool failed = false;
+    bool progress = true;
+    for (;;) {
+        // fill every idle slot with the next piece in file order
+        while (!failed && !idle.empty() && range < ranges.size()) {
+            const CopyRange& r = ranges[range];
+            if (rangeDone == r.size) {
+                ++range;
+                rangeDone = 0;
+                continue;
+            }
+            unsigned index = idle.back();
+            UringSlot& s = slot[index];
+            s.file = rangeFile[range];
+            s.srcOffset = r.srcOffset + rangeDone;
+            s.dstOffset = r.dstOffset + rangeDone;
+            s.size = min(URING_SLOT_SIZE, r.size - rangeDone);
+            s.done = 0;
+            s.writing = false;
+            if (!QueueSlot(ring, s, index, buff)) {
+                break;
+            }
+            idle.pop_back();
+            rangeDone += s.size;
+            ++active;
+        }
+
+        if (active == 0) {
+            return failed ? COPY_UNSUPPORTED : 0;
+        }
+        if (ring.submit(1) < 0) {
+            // one more try to wait for what is in flight, unless the last
+            // failed wait brought nothing back either
+            if (!progress) {
+                *drained = false;
+                return COPY_UNSUPPORTED;
+            }
+            failed = true;
+            progress = false;
+        }
+
+        uint64_t userData;
+        int32_t res;
+        while (ring.popCompletion(&userData, &res)) {
+            progress = true;
+            UringSlot& s = slot[userData];
+            bool finished = false;
+            if (res <= 0) {
+                // a short source or an opcode this kernel lacks alike
+                failed = true;
+            }
+            else {
+                s.done += res;
+                if (s.done < s.size) {
+                    // the rest of a short read or write
+                }
+                else if (!s.writing) {
+                    s.writing = true;
+                    s.done = 0;
+                }
+                else {
+                    finished = true;
+                }
+            }
+            if (failed || finished) {
+                idle.push_back(userData);
+                --active;
+                continue;
+            }
+            // there is room, the slot's previous entry has just completed
+            QueueSlot(ring, s, userData, buff);
+        }
+    }
+}
+
+int
+CopyFileRangesUring(const vector<CopyRange>& ranges, int dstFD, unsigned queueDepth, off_t maxInFlightBytes, CopyPath *path)
+{
+    *path = COPY_PATH_IO_URING;
+
+    unsigned slots = max(1u, queueDepth);
+    if (maxInFlightBytes > 0) {
+        slots = max((off_t)1, min((off_t)slots, maxInFlightBytes / URING_SLOT_SIZE));
+    }
+
+    void *buff = NULL;
+    if (posix_memalign(&buff, COPY_BUFFER_ALIGN, slots * URING_SLOT_SIZE) != 0) {
+        return COPY_UNSUPPORTED;
+    }
+    bool drained;
+    int ret = RunUringCopy(ranges, dstFD, slots, (uint8_t *)buff, &drained);
+    if (drained) {
+        free(buff);
+    }
+    // else leaked on purpose, the kernel may still write into it
+    return ret;
+}
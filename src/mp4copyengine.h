@@ -0,0 +1,77 @@
+#ifndef MP4_COPY_ENGINE_H
+#define MP4_COPY_ENGINE_H
+
+#include <sys/types.h>
+
+#include <vector>
+
+enum CopyPath
+{
+    COPY_PATH_NONE,
+    COPY_PATH_COPY_FILE_RANGE,  // in-kernel, may share or offload on the fs
+    COPY_PATH_SENDFILE,         // in-kernel through the page cache
+    COPY_PATH_SPLICE,           // in-kernel through a pipe
+    COPY_PATH_BUFFER,           // pread()/write() through a 1 MiB buffer
+    COPY_PATH_REFLINK,          // blocks shared with the source (FICLONERANGE)
+    COPY_PATH_IO_URING,         // reads and writes queued on an io_uring
+};
+
+const char* CopyPathName(CopyPath path);
+
+/*
+ * Copy size bytes at srcOffset of srcFD to the current position of dstFD,
+ * which advances by size. The kernel paths are tried in the order above
+ * and a path the files do not support hands over to the next one where it
+ * stopped. *path tells which one finished the copy.
+ */
+int CopyFileData(int srcFD, off_t srcOffset, int dstFD, off_t size, CopyPath *path);
+
+/*
+ * As CopyFileData(), with dstOffset being the current position of dstFD.
+ * When srcOffset and dstOffset sit at the same place within a blockSize
+ * block, the whole blocks in between are cloned and only the partial
+ * head and tail block are copied. Anything the filesystem refuses to
+ * clone is copied instead; *path is COPY_PATH_REFLINK only if the clone
+ * went through.
+ */
+int CloneFileData(int srcFD, off_t srcOffset, int dstFD, off_t dstOffset, off_t size, off_t blockSize, CopyPath *path);
+
+/*
+ * As CopyFileData(), with dstOffset being the current position of dstFD,
+ * but in 8 MiB steps that leave the page cache as it was: the source pages
+ * of each step are dropped once copied, the output of each step is handed
+ * to writeback right away, and waited for and dropped one step later.
+ * Dirty pages then stay at about two steps instead of piling up for the
+ * flusher. Where the platform has none of that this is CopyFileData().
+ */
+int CopyFileDataPaced(int srcFD, off_t srcOffset, int dstFD, off_t dstOffset, off_t size, CopyPath *path);
+
+struct CopyRange
+{
+    int srcFD;
+    off_t srcOffset;
+    off_t dstOffset;
+    off_t size;
+};
+
+/*
+ * Copy every range to its own dstOffset of dstFD with up to threads
+ * workers. Ranges are cut into pieces that the workers take in order; no
+ * more than maxInFlightBytes of pieces are being copied at once (0 for no
+ * cap). Pieces go through copy_file_range() with explicit offsets, or
+ * pread()/pwrite() where that is not supported, so the file position of
+ * dstFD is neither used nor moved. *path is the slowest path any piece
+ * took.
+ */
+int CopyFileRangesParallel(const std::vector<CopyRange>& ranges, int dstFD, int threads, off_t maxInFlightBytes, CopyPath *path);
+
+/*
+ * As CopyFileRangesParallel(), from a single thread that keeps up to
+ * queueDepth reads and writes of 1 MiB pieces in flight on an io_uring,
+ * with the files and buffers registered. Returns 1 when io_uring is not
+ * there or gives up; every copy is by offset, so another path can simply
+ * do the whole job again.
+ */
+int CopyFileRangesUring(const std::vector<CopyRange>& ranges, int dstFD, unsigned queueDepth, off_t maxInFlightBytes, CopyPath *path);
+
+#endif // MP4_COPY_ENGINE_H
@@ -1,6 +1,13 @@
 #include "mp4extractor.h"
 
 #include "mp4trimmer.h"
+#include "mp4sampletable.h"
+#include "mp4uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
 
 
 #ifdef __ANDROID__
@@ -17,12 +24,15 @@
 
 using namespace std;
 
+#define FRAME_BATCH_COUNT   16          // frames read ahead per submission
+#define FRAME_BATCH_SIZE    (4 << 20)   // registered buffer they land in
+
 MP4Extractor::~MP4Extractor()
 {}
 
 class RealMP4Extractor : public MP4Extractor {
 public:
-	explicit RealMP4Extractor(string filePath);
+	RealMP4Extractor(string filePath, bool useIOUring);
 	~RealMP4Extractor();
 
 	virtual bool seek(int ms) override;
@@ -48,16 +58,32 @@ public:
 	bool prepare();
 
 private:
-	char* readData(int32_t offset, int32_t len);
+	char* readData(off_t offset, int32_t len);
+
+	void setupRing();
+	bool readBatch(int cursor);
+	char* takeBatchedFrame(int cursor, int32_t len);
 
 private:
 	string mFilePath;
 
+	bool mUseIOUring;
+	IOUring *mRing;
+	uint8_t *mBatch;
+
+	// frames [mBatchFirst, mBatchFirst + mBatchCount) sit in mBatch, each
+	// at mBatchOffsets[i] unless mBatchValid[i] says the read fell short
+	int mBatchFirst;
+	int mBatchCount;
+	size_t mBatchOffsets[FRAME_BATCH_COUNT];
+	bool mBatchValid[FRAME_BATCH_COUNT];
+
 	MP4Info *mInfo;
 
 	int mMediaDurationMs;
 
 	TrackInfo *mVideoTrackInfo;
+	CompactSampleTable mVideoTable;
 
 	FILE *mFile;
 
@@ -77,8 +103,13 @@ private:
 	int mCurrentCursor;
 };
 
-RealMP4Extractor::RealMP4Extractor(string filePath)
+RealMP4Extractor::RealMP4Extractor(string filePath, bool useIOUring)
 		: mFilePath(filePath)
+		, mUseIOUring(useIOUring)
+		, mRing(nullptr)
+		, mBatch(nullptr)
+		, mBatchFirst(-1)
+		, mBatchCount(0)
 		, mInfo(nullptr)
 		, mMediaDurationMs(0)
 		, mVideoTrackInfo(nullptr)
@@ -96,6 +127,10 @@ RealMP4Extractor::RealMP4Extractor(string filePath)
 
 RealMP4Extractor::~RealMP4Extractor()
 {
+	// the ring goes before the buffer registered with it
+	delete mRing;
+	free(mBatch);
+
 	if (mFile != nullptr) {
 		::fclose(mFile);
 	}
@@ -108,7 +143,7 @@ RealMP4Extractor::~RealMP4Extractor()
 bool
 RealMP4Extractor::prepare()
 {
-	mInfo = ExtractMP4Info(mFilePath);
+	mInfo = ExtractMP4Info(mFilePath, EXTRACT_MODE_LAZY);
 	if (mInfo == nullptr) {
 		_W("read mp4info failed! %s", mFilePath.c_str());
 		return false;
@@ -121,6 +156,20 @@ RealMP4Extractor::prepare()
 		_W("no video track found! %s", mFilePath.c_str());
 		return false;
 	}
+
+	// the audio track is never read, leave its tables on disk
+	if (LoadTrackTables(mInfo, mVideoTrackInfo) != 0) {
+		_W("read video sample tables failed! %s", mFilePath.c_str());
+		return false;
+	}
+
+	// keep only the compact index resident for the life of the extractor
+	if (mVideoTable.build(mVideoTrackInfo) != 0) {
+		_W("bad video sample tables! %s", mFilePath.c_str());
+		return false;
+	}
+	ReleaseTrackTables(mVideoTrackInfo);
+	_I("video index: %zu bytes \n", mVideoTable.memoryFootprint());
 	
 	mFile = ::fopen(mFilePath.c_str(), "rb");
 	if (mFile == nullptr) {
@@ -128,17 +177,21 @@ RealMP4Extractor::prepare()
 		return false;
 	}
 
+	if (mUseIOUring) {
+		setupRing();
+	}
+
 	mVideoWidth = mVideoTrackInfo->avcWidth;
 	mVideoHeight = mVideoTrackInfo->avcHeight;
 	_I("frame matrix: %d * %d\n", mVideoWidth, mVideoHeight);
 
-	mTotalFrameCount = mVideoTrackInfo->stsz.size();
+	mTotalFrameCount = mVideoTable.sampleCount();
 	_I("total frame count: %d \n", mTotalFrameCount);
 
-	long delta = mVideoTrackInfo->stts[0].delta;
+	long delta = mVideoTable.sampleDelta(0);
 	delta = delta * 1000000 / mVideoTrackInfo->timeScale;
 
-	mSampleDurationUs = delta; //mVideoTrackInfo->stts[0].delta;
+	mSampleDurationUs = delta;
 	_I("sample duration is %d \n", mSampleDurationUs);
 
 	seek(0);
@@ -156,26 +209,22 @@ RealMP4Extractor::seek(int ms)
 	mAnchorMs = ms;
 	_I("seek to %dms \n", ms);
 
-	mAnchorCursor = ms * 1000 / mSampleDurationUs;
+	uint64_t t = (uint64_t)ms * mVideoTrackInfo->timeScale / 1000;
+	mAnchorCursor = mVideoTable.timeIndex().lastSampleAtOrBefore(t);
 
 	if (mAnchorCursor >= mTotalFrameCount) {
 		mAnchorCursor = mTotalFrameCount - 1;
 	}
 
-	mPreviousIFrameCursor = mAnchorCursor + 1;
-	for (int i = 1; i < mVideoTrackInfo->stss.size(); ++i) {
-		if (mVideoTrackInfo->stss[i - 1] <= mPreviousIFrameCursor &&
-				mPreviousIFrameCursor < mVideoTrackInfo->stss[i]) {
-			mPreviousIFrameCursor = mVideoTrackInfo->stss[i - 1];
-			break;
-		}
-	}
-	mPreviousIFrameCursor--;
+	mPreviousIFrameCursor = mVideoTable.keyFrameAtOrBefore(mAnchorCursor);
 
 	mAnchorCursor = mPreviousIFrameCursor;
 
 	mCurrentCursor = mAnchorCursor;
 
+	// what was read ahead belongs to the old position
+	mBatchCount = 0;
+
 	_I("anchors: %d - %d - %d \n", mPreviousIFrameCursor, mAnchorCursor, mCurrentCursor);
 
 	mAccessableFrameCount = mTotalFrameCount - mAnchorCursor;
@@ -188,11 +237,11 @@ RealMP4Extractor::seek(int ms)
 }
 
 char*
-RealMP4Extractor::readData(int32_t offset, int32_t len)
+RealMP4Extractor::readData(off_t offset, int32_t len)
 {
 	// TODO
 
-	::fseek(mFile, offset, SEEK_SET);
+	::fseeko(mFile, offset, SEEK_SET);
 
 	char* buff = new char[len];
 
@@ -201,6 +250,97 @@ RealMP4Extractor::readData(int32_t offset, int32_t len)
 	return buff;
 }
 
+void
+RealMP4Extractor::setupRing()
+{
+	void *buff = nullptr;
+	if (posix_memalign(&buff, 4096, FRAME_BATCH_SIZE) != 0) {
+		return;
+	}
+	mBatch = (uint8_t *)buff;
+
+	mRing = new IOUring();
+	if (!mRing->init(FRAME_BATCH_COUNT)) {
+		_I("no io_uring, frames are read one by one \n");
+		delete mRing;
+		mRing = nullptr;
+		return;
+	}
+
+	int fd = ::fileno(mFile);
+	mRing->registerFiles(&fd, 1);
+	struct iovec iov = { mBatch, FRAME_BATCH_SIZE };
+	mRing->registerBuffers(&iov, 1);
+}
+
+/*
+ * Read the frames from cursor on, as many as fit in the batch buffer, with
+ * one submission. False when not even the frame at cursor fits.
+ */
+bool
+RealMP4Extractor::readBatch(int cursor)
+{
+	mBatchFirst = cursor;
+	mBatchCount = 0;
+
+	size_t used = 0;
+	int last = min(cursor + FRAME_BATCH_COUNT, mTotalFrameCount);
+	for (int i = cursor; i < last; ++i) {
+		size_t len = mVideoTable.sampleSize(i);
+		if (used + len > FRAME_BATCH_SIZE) {
+			break;
+		}
+		if (!mRing->prepRead(0, mBatch + used, len, mVideoTable.sampleOffset(i), 0, mBatchCount)) {
+			break;
+		}
+		mBatchOffsets[mBatchCount] = used;
+		mBatchValid[mBatchCount] = false;
+		used += len;
+		++mBatchCount;
+	}
+	if (mBatchCount == 0) {
+		return false;
+	}
+
+	for (int completed = 0; completed < mBatchCount; ) {
+		if (mRing->submit(mBatchCount - completed) < 0) {
+			// the reads may still be in flight, never trust the buffer again
+			_W("io_uring submit failed, frames are read one by one \n");
+			delete mRing;
+			mRing = nullptr;
+			mBatchCount = 0;
+			return false;
+		}
+		uint64_t index;
+		int32_t res;
+		while (mRing->popCompletion(&index, &res)) {
+			mBatchValid[index] = res == (int32_t)mVideoTable.sampleSize(cursor + index);
+			++completed;
+		}
+	}
+
+	return true;
+}
+
+char*
+RealMP4Extractor::takeBatchedFrame(int cursor, int32_t len)
+{
+	if (mBatchCount == 0 || cursor < mBatchFirst || cursor >= mBatchFirst + mBatchCount) {
+		if (!readBatch(cursor)) {
+			return nullptr;
+		}
+	}
+
+	int i = cursor - mBatchFirst;
+	if (!mBatchValid[i]) {
+		return nullptr;
+	}
+
+	char* buff = new char[len];
+	memcpy(buff, mBatch + mBatchOffsets[i], len);
+	return buff;
+}
+
 void
 RealMP4Extractor::releaseFrame(void **data)
 {
@@ -255,9 +395,14 @@ RealMP4Extractor::getNextFrame(void **data, int32_t *len)
 		return false;
 	}
 
-	int32_t offset = mVideoTrackInfo->stco[mCurrentCursor].chunkOffset; // FIXME
-	*len = mVideoTrackInfo->stsz[mCurrentCursor];
-	*data = readData(offset, *len);
+	off_t offset = mVideoTable.sampleOffset(mCurrentCursor);
+	*len = mVideoTable.sampleSize(mCurrentCursor);
+	if (mRing != nullptr) {
+		*data = takeBatchedFrame(mCurrentCursor, *len);
+	}
+	if (*data == nullptr) {
+		*data = readData(offset, *len);
+	}
 
 	++mCurrentCursor;
 	--mRemainedFrameCount;
@@ -266,9 +411,9 @@ RealMP4Extractor::getNextFrame(void **data, int32_t *len)
 }
 
 MP4Extractor*
-createMP4Extractor(string filePath)
+createMP4Extractor(string filePath, bool useIOUring)
 {
-	RealMP4Extractor* extractor = new RealMP4Extractor(filePath);
+	RealMP4Extractor* extractor = new RealMP4Extractor(filePath, useIOUring);
 	if (extractor->prepare()) {
 		return extractor;
 	}
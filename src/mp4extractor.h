@@ -30,7 +30,9 @@ public:
 	virtual int32_t remainedFrameCount() const = 0;
 };
 
-MP4Extractor* createMP4Extractor(std::string filePath);
+// with useIOUring, upcoming frames are read ahead in batches on an
+// io_uring where the kernel has one
+MP4Extractor* createMP4Extractor(std::string filePath, bool useIOUring = false);
 void destroyMP4Extractor(MP4Extractor*);
 
 #endif // MP4_EXTRACTOR_H
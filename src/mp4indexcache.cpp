@@ -0,0 +1,462 @@
+#include "mp4indexcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+using namespace std;
+
+#ifdef __ANDROID__
+#define _I(...) do {} while(0)
+#define _W(...) do {} while(0)
+#define _E(...) do {} while(0)
+#endif
+
+#ifdef __APPLE__
+#define _I printf
+#define _W printf
+#define _E printf
+#endif
+
+#define INDEX_CACHE_MAGIC       0x4d503458 // 'MP4X'
+// bump by hand on any change to the structs or sections written below, so
+// old entries are ignored rather than misread
+#define INDEX_CACHE_VERSION     2
+#define INDEX_CACHE_BYTE_ORDER  0x01020304
+#define INDEX_CACHE_SUFFIX      ".mp4idx"
+
+#define TRACK_VIDEO 1
+#define TRACK_AUDIO 2
+
+enum
+{
+    TABLE_STTS,
+    TABLE_CTTS,
+    TABLE_STSS,
+    TABLE_STSZ,
+    TABLE_STSC,
+    TABLE_STCO,
+    TABLE_COUNT
+};
+
+// every section starts 8-byte aligned so the mapped file can be read in place
+struct CacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t reserved;
+
+    uint64_t fileSize; // of the cache entry itself
+
+    // source key
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint32_t pathLength;
+
+    uint32_t trackMask;
+
+    int64_t mdatOffset;
+    uint64_t mdatSize;
+    int64_t moovOffset;
+    uint64_t moovSize;
+    int32_t mdatHeaderSize;
+    int32_t timeScale;
+    int32_t duration;
+    int32_t trackCount;
+};
+
+struct CacheTrack
+{
+    int32_t trackID;
+    int32_t duration;
+    int32_t width;
+    int32_t height;
+    int32_t timeScale;
+    int16_t avcWidth;
+    int16_t avcHeight;
+    int32_t avcCodecSpecLen;
+    int32_t codecSpecDataLen;
+
+    int64_t tablesOffset;
+    uint64_t tablesSize;
+
+    uint64_t tableCount[TABLE_COUNT];
+};
+
+static string sCacheDir;
+
+void
+SetMP4IndexCacheDir(const string& dir)
+{
+    sCacheDir = dir;
+}
+
+const string&
+MP4IndexCacheDir()
+{
+    return sCacheDir;
+}
+
+static string
+CanonicalPath(const string& filePath)
+{
+    char resolved[PATH_MAX];
+    if (realpath(filePath.c_str(), resolved) == NULL) {
+        return filePath;
+    }
+    return resolved;
+}
+
+// FNV-1a of the canonical source path
+static string
+CacheEntryPath(const string& sourcePath)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < sourcePath.size(); ++i) {
+        hash ^= (uint8_t)sourcePath[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    return sCacheDir + "/" + name + INDEX_CACHE_SUFFIX;
+}
+
+static void
+FillSourceKey(CacheHeader *header, const struct stat& st)
+{
+    header->device = st.st_dev;
+    header->inode = st.st_ino;
+    header->size = st.st_size;
+#ifdef __linux__
+    header->mtimeSec = st.st_mtim.tv_sec;
+    header->mtimeNsec = st.st_mtim.tv_nsec;
+#else
+    header->mtimeSec = st.st_mtimespec.tv_sec;
+    header->mtimeNsec = st.st_mtimespec.tv_nsec;
+#endif
+}
+
+static void
+Append(vector<uint8_t>& out, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    out.insert(out.end(), p, p + len);
+    out.resize((out.size() + 7) & ~(size_t)7, 0);
+}
+
+template <typename T>
+static void
+AppendTable(vector<uint8_t>& out, const vector<T>& table)
+{
+    if (!table.empty()) {
+        Append(out, &table[0], table.size() * sizeof(T));
+    }
+}
+
+static void
+AppendTrack(vector<uint8_t>& out, const TrackInfo *ti)
+{
+    CacheTrack track;
+    memset(&track, 0, sizeof(track));
+    track.trackID = ti->trackID;
+    track.duration = ti->duration;
+    track.width = ti->_width;
+    track.height = ti->_height;
+    track.timeScale = ti->timeScale;
+    track.avcWidth = ti->avcWidth;
+    track.avcHeight = ti->avcHeight;
+    track.avcCodecSpecLen = ti->avcCodecSpec != NULL ? ti->avcCodecSpecLen : 0;
+    track.codecSpecDataLen = ti->codecSpecData != NULL ? ti->codecSpecDataLen : 0;
+    track.tablesOffset = ti->mTablesOffset;
+    track.tablesSize = ti->mTablesSize;
+    track.tableCount[TABLE_STTS] = ti->stts.size();
+    track.tableCount[TABLE_CTTS] = ti->ctts.size();
+    track.tableCount[TABLE_STSS] = ti->stss.size();
+    track.tableCount[TABLE_STSZ] = ti->stsz.size();
+    track.tableCount[TABLE_STSC] = ti->stsc.size();
+    track.tableCount[TABLE_STCO] = ti->stco.size();
+    Append(out, &track, sizeof(track));
+
+    Append(out, ti->avcCodecSpec, track.avcCodecSpecLen);
+    Append(out, ti->codecSpecData, track.codecSpecDataLen);
+
+    AppendTable(out, ti->stts);
+    AppendTable(out, ti->ctts);
+    AppendTable(out, ti->stss);
+    AppendTable(out, ti->stsz);
+    AppendTable(out, ti->stsc);
+    AppendTable(out, ti->stco);
+}
+
+int
+StoreMP4IndexCache(const MP4Info *mp4info)
+{
+    if (sCacheDir.empty() || mp4info == NULL) {
+        return -1;
+    }
+
+    const TrackInfo *tracks[] = { mp4info->mVideoTrackInfo, mp4info->mAudioTrackInfo };
+    for (int i = 0; i < 2; ++i) {
+        if (tracks[i] != NULL && tracks[i]->mTablesDeferred) {
+            return -2;
+        }
+    }
+
+    string sourcePath = CanonicalPath(mp4info->mFilePath);
+    struct stat st;
+    if (stat(sourcePath.c_str(), &st) != 0) {
+        return -3;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_CACHE_MAGIC;
+    header.version = INDEX_CACHE_VERSION;
+    header.byteOrder = INDEX_CACHE_BYTE_ORDER;
+    FillSourceKey(&header, st);
+    header.pathLength = sourcePath.size();
+    header.trackMask = (tracks[0] != NULL ? TRACK_VIDEO : 0) | (tracks[1] != NULL ? TRACK_AUDIO : 0);
+    header.mdatOffset = mp4info->mdatOffset;
+    header.mdatSize = mp4info->mdatSize;
+    header.moovOffset = mp4info->moovOffset;
+    header.moovSize = mp4info->moovSize;
+    header.mdatHeaderSize = mp4info->mdatHeaderSize;
+    header.timeScale = mp4info->timeScale;
+    header.duration = mp4info->duration;
+    header.trackCount = mp4info->trackCount;
+
+    vector<uint8_t> out;
+    Append(out, &header, sizeof(header));
+    Append(out, sourcePath.data(), sourcePath.size());
+    for (int i = 0; i < 2; ++i) {
+        if (tracks[i] != NULL) {
+            AppendTrack(out, tracks[i]);
+        }
+    }
+    ((CacheHeader *)&out[0])->fileSize = out.size();
+
+    // write aside and rename, readers only ever see complete entries
+    string entryPath = CacheEntryPath(sourcePath);
+    string tempPath = entryPath + ".XXXXXX";
+
+    // a name of its own, so writers of the same entry never share a file
+    int fd = mkstemp(&tempPath[0]);
+    if (fd < 0) {
+        _W("create index cache %s failed \n", tempPath.c_str());
+        return -4;
+    }
+    fchmod(fd, 0644);
+
+    size_t written = 0;
+    while (written < out.size()) {
+        ssize_t r = ::write(fd, &out[written], out.size() - written);
+        if (r <= 0) {
+            break;
+        }
+        written += r;
+    }
+    ::close(fd);
+
+    if (written != out.size() || rename(tempPath.c_str(), entryPath.c_str()) != 0) {
+        _W("write index cache %s failed \n", entryPath.c_str());
+        unlink(tempPath.c_str());
+        return -5;
+    }
+
+    return 0;
+}
+
+struct CacheReader
+{
+    const uint8_t *mData;
+    size_t mSize;
+    size_t mPosition;
+
+    CacheReader(const uint8_t *data, size_t size) : mData(data), mSize(size), mPosition(0) {}
+
+    const uint8_t* take(uint64_t len) {
+        if (len > mSize - mPosition) {
+            return NULL;
+        }
+        const uint8_t *p = mData + mPosition;
+        mPosition = (mPosition + len + 7) & ~(size_t)7;
+        if (mPosition > mSize) {
+            mPosition = mSize;
+        }
+        return p;
+    }
+
+    template <typename T>
+    bool table(uint64_t count, vector<T>& out) {
+        if (count > (mSize - mPosition) / sizeof(T)) {
+            return false;
+        }
+        const T *p = (const T *)take(count * sizeof(T));
+        out.assign(p, p + count);
+        return true;
+    }
+};
+
+static char*
+CopyBlob(const uint8_t *data, int32_t len)
+{
+    if (data == NULL || len <= 0) {
+        return NULL;
+    }
+    char *blob = new char[len];
+    memcpy(blob, data, len);
+    return blob;
+}
+
+static TrackInfo*
+ReadTrack(CacheReader& r, bool isVideo)
+{
+    const CacheTrack *track = (const CacheTrack *)r.take(sizeof(CacheTrack));
+    if (track == NULL || track->avcCodecSpecLen < 0 || track->codecSpecDataLen < 0) {
+        return NULL;
+    }
+
+    TrackInfo *ti = new TrackInfo();
+    ti->mIsVideo = isVideo;
+    ti->trackID = track->trackID;
+    ti->duration = track->duration;
+    ti->_width = track->width;
+    ti->_height = track->height;
+    ti->timeScale = track->timeScale;
+    ti->avcWidth = track->avcWidth;
+    ti->avcHeight = track->avcHeight;
+    ti->mTablesDeferred = false;
+    ti->mTablesOffset = track->tablesOffset;
+    ti->mTablesSize = track->tablesSize;
+
+    const uint8_t *avcCodecSpec = r.take(track->avcCodecSpecLen);
+    const uint8_t *codecSpecData = r.take(track->codecSpecDataLen);
+    bool ok = avcCodecSpec != NULL && codecSpecData != NULL
+        && r.table(track->tableCount[TABLE_STTS], ti->stts)
+        && r.table(track->tableCount[TABLE_CTTS], ti->ctts)
+        && r.table(track->tableCount[TABLE_STSS], ti->stss)
+        && r.table(track->tableCount[TABLE_STSZ], ti->stsz)
+        && r.table(track->tableCount[TABLE_STSC], ti->stsc)
+        && r.table(track->tableCount[TABLE_STCO], ti->stco);
+    if (!ok) {
+        delete ti;
+        return NULL;
+    }
+
+    ti->avcCodecSpec = CopyBlob(avcCodecSpec, track->avcCodecSpecLen);
+    ti->avcCodecSpecLen = ti->avcCodecSpec != NULL ? track->avcCodecSpecLen : 0;
+    ti->codecSpecData = CopyBlob(codecSpecData, track->codecSpecDataLen);
+    ti->codecSpecDataLen = ti->codecSpecData != NULL ? track->codecSpecDataLen : 0;
+    return ti;
+}
+
+static void
+DeleteTrack(TrackInfo *ti)
+{
+    if (ti != NULL) {
+        delete[] ti->avcCodecSpec;
+        delete[] ti->codecSpecData;
+        delete ti;
+    }
+}
+
+MP4Info*
+LoadMP4IndexCache(const string& filePath)
+{
+    if (sCacheDir.empty()) {
+        return NULL;
+    }
+
+    string sourcePath = CanonicalPath(filePath);
+    struct stat st;
+    if (stat(sourcePath.c_str(), &st) != 0) {
+        return NULL;
+    }
+
+    string entryPath = CacheEntryPath(sourcePath);
+    int fd = ::open(entryPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat est;
+    if (fstat(fd, &est) != 0 || (size_t)est.st_size < sizeof(CacheHeader)) {
+        ::close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, est.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    CacheReader r((const uint8_t *)map, est.st_size);
+    const CacheHeader *header = (const CacheHeader *)r.take(sizeof(CacheHeader));
+
+    CacheHeader key;
+    FillSourceKey(&key, st);
+
+    bool ok = header->magic == INDEX_CACHE_MAGIC
+        && header->version == INDEX_CACHE_VERSION
+        && header->byteOrder == INDEX_CACHE_BYTE_ORDER
+        && header->fileSize == (uint64_t)est.st_size
+        && header->device == key.device
+        && header->inode == key.inode
+        && header->size == key.size
+        && header->mtimeSec == key.mtimeSec
+        && header->mtimeNsec == key.mtimeNsec
+        && header->pathLength == sourcePath.size();
+
+    const uint8_t *path = ok ? r.take(header->pathLength) : NULL;
+    ok = path != NULL && memcmp(path, sourcePath.data(), sourcePath.size()) == 0;
+
+    MP4Info *mp4info = NULL;
+    if (ok) {
+        mp4info = new MP4Info();
+        mp4info->mFilePath = filePath;
+        mp4info->mdatOffset = header->mdatOffset;
+        mp4info->mdatSize = header->mdatSize;
+        mp4info->mdatHeaderSize = header->mdatHeaderSize;
+        mp4info->moovOffset = header->moovOffset;
+        mp4info->moovSize = header->moovSize;
+        mp4info->timeScale = header->timeScale;
+        mp4info->duration = header->duration;
+        mp4info->trackCount = header->trackCount;
+
+        if (header->trackMask & TRACK_VIDEO) {
+            mp4info->mVideoTrackInfo = ReadTrack(r, true);
+            ok = mp4info->mVideoTrackInfo != NULL;
+        }
+        if (ok && (header->trackMask & TRACK_AUDIO)) {
+            mp4info->mAudioTrackInfo = ReadTrack(r, false);
+            ok = mp4info->mAudioTrackInfo != NULL;
+        }
+
+        if (!ok) {
+            DeleteTrack(mp4info->mVideoTrackInfo);
+            DeleteTrack(mp4info->mAudioTrackInfo);
+            delete mp4info;
+            mp4info = NULL;
+        }
+    }
+
+    munmap(map, est.st_size);
+
+    if (!ok) {
+        _W("ignore stale index cache %s \n", entryPath.c_str());
+    }
+    return mp4info;
+}
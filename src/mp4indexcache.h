@@ -0,0 +1,26 @@
+#ifndef MP4_INDEX_CACHE_H
+#define MP4_INDEX_CACHE_H
+
+#include <string>
+
+#include "mp4trimmer.h"
+
+/*
+ * On-disk cache of parsed MP4Info, one file per source in the cache
+ * directory. An entry is keyed by the source path, inode, size and mtime
+ * and is ignored as soon as any of them changes. Entries hold the sample
+ * tables (stco with its first sample per chunk) and the stss key frames
+ * in host layout, so loading is one mmap() plus a copy per table.
+ *
+ * The cache is off until a directory is set; an empty path turns it off.
+ */
+void SetMP4IndexCacheDir(const std::string& dir);
+const std::string& MP4IndexCacheDir();
+
+// NULL on a miss, a stale entry or any mismatch
+MP4Info* LoadMP4IndexCache(const std::string& filePath);
+
+// only complete (non-deferred) tables are stored
+int StoreMP4IndexCache(const MP4Info *mp4info);
+
+#endif // MP4_INDEX_CACHE_H
@@ -2,8 +2,12 @@
 
 #include <algorithm>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <libgen.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 #ifdef __ANDROID__
 #include <sys/endian.h>
@@ -31,7 +35,19 @@ using namespace std;
 MP4Rewriter::MP4Rewriter()
     : mPath()
     , mFD(-1)
+    , mOwnFD(false)
+    , mSequentialOutput(false)
     , mOffset(0)
+    , mError(0)
+    , mMediaDataOffset(0)
+    , mCopyPath(COPY_PATH_NONE)
+    , mBlockSize(0)
+    , mMediaDataPadding(0)
+    , mMediaDataSize(0)
+    , mLargeMediaDataHeader(false)
+    , mHoldOutput(false)
+    , mDryRun(false)
+    , mPendingSrc(-1)
     , mIsWritingVideoTrack(false)
     , mIsWritingAudioTrack(false)
     , mMP4Info(NULL)
@@ -49,92 +65,607 @@ MP4Rewriter::setOutputPath(const string path)
 	return 0;
 }
 
+int
+MP4Rewriter::setOutputFD(int fd)
+{
+	mFD = fd;
+	mOwnFD = false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return -1;
+	}
+	mSequentialOutput = !S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode);
+	if (mSequentialOutput) {
+		_I("sequential output to fd %d \n", fd);
+		return 0;
+	}
+
+	// offsets in the boxes and every pwrite() count from the start of the
+	// file, so the output has to start there too
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || (flags & O_APPEND) || lseek(fd, 0, SEEK_CUR) != 0) {
+		_E("fd %d is not positioned at the start of its file \n", fd);
+		return -1;
+	}
+
+	return 0;
+}
+
 int
 MP4Rewriter::open()
 {
 	if (mFD == -1) {
 		mFD = ::open(mPath.c_str(), O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+		mOwnFD = true;
+		if (mFD < 0) {
+			_E("open %s failed \n", mPath.c_str());
+			return -1;
+		}
+	}
+
+	// nothing to clone into on a sequential output
+	struct stat st;
+	if (mOptions.reflink && !mSequentialOutput && mFD != -1 && fstat(mFD, &st) == 0) {
+		mBlockSize = st.st_blksize;
 	}
 
 	return 0;
 }
 
 int
-MP4Rewriter::close()
+MP4Rewriter::setOptions(const MP4WriteOptions& options)
 {
-	::close(mFD);
+	mOptions = options;
+
 	return 0;
 }
 
+/*
+ * Bytes to put in front of media data from sourceOffset that would
+ * otherwise land at outputOffset, so both sit at the same place within a
+ * filesystem block and the whole blocks can be cloned; 0 unless reflink
+ * is on.
+ */
+off_t
+MP4Rewriter::alignmentPadding(off_t outputOffset, off_t sourceOffset) const
+{
+	if (mBlockSize <= 0) {
+		return 0;
+	}
+	off_t pad = (sourceOffset - outputOffset) % mBlockSize;
+	return pad < 0 ? pad + mBlockSize : pad;
+}
+
 int
-MP4Rewriter::copyData(int src, off_t posi, int size, const string srcName)
-{
-	_W("src(%d): %lld + %d \n", src, posi, size);
-    lseek(src, posi, SEEK_SET);
-    int left = size;
-    char buff[4096];
-    while (left) {
-        ssize_t r = read(src, buff, std::min((int)sizeof(buff), left));
-        if (r > 0) {
-            left -= r;
-            while (r > 0) {
-                ssize_t w = ::write(mFD, buff, r);
-                if (w > r) {
-                    _E("write more then wanted, this is impossible, %ld/%ld", w, r);
-                    return -1;
-                } else if (w > 0) {
-                    r -= w;
-                } else {
-                    _E("got %ld when write to %s", w, mPath.c_str());
-                    return -1;
-                }
-            }
+MP4Rewriter::close()
+{
+	int ret = runPendingCopies();
+	if (flush() != 0 || mError != 0) {
+		ret = -1;
+	}
+	if (mOwnFD && mFD >= 0) {
+		::close(mFD);
+	}
+	return ret;
+}
 
-        } else if (r == 0) {
-            _W("read 0 byte from %s, this is strange, %d/%d", srcName.c_str(), left, size);
-            left = 0;
+// writev() until every byte of iov is out, iov is consumed on the way
+static int
+WriteFully(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t w = ::writev(fd, iov, iovcnt);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             return -1;
+        }
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
 
-        } else {
-            _E("got %ld when read from %s", r, srcName.c_str());
-            return -1;
+int
+MP4Rewriter::flush()
+{
+    // an open box still has its size to be filled in
+    if (mError != 0) {
+        return mError;
+    }
+    if (mBuffer.empty() || !mBoxes.empty() || mHoldOutput) {
+        return 0;
+    }
+
+    if (mDryRun) {
+        mBuffer.clear();
+        return 0;
+    }
+
+    int ret = 0;
+    if (mPendingCopies.empty()) {
+        struct iovec iov = { &mBuffer[0], mBuffer.size() };
+        ret = WriteFully(mFD, &iov, 1);
+    }
+    else {
+        // the file position is behind queued media data, go by offset
+        off_t offset = mOffset - mBuffer.size();
+        for (size_t written = 0; written < mBuffer.size() && ret == 0; ) {
+            ssize_t w = pwrite(mFD, &mBuffer[written], mBuffer.size() - written, offset + written);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            ret = w > 0 ? 0 : -1;
+            written += w > 0 ? w : 0;
         }
     }
+    if (ret != 0) {
+        // the bytes after these would land at the wrong offsets
+        _E("flush %zu bytes to %s failed \n", mBuffer.size(), mPath.c_str());
+        mError = ret;
+    }
+    mBuffer.clear();
+    return ret;
+}
+
+int
+MP4Rewriter::copyData(int src, off_t posi, off_t size, const string srcName)
+{
+	_I("src(%d): %lld + %lld \n", src, (long long)posi, (long long)size);
+
+	// the boxes before the media data have to be out first
+	if (flush() != 0) {
+		return -1;
+	}
+
+	if (mDryRun) {
+		mOffset += size;
+		return 0;
+	}
+
+	// queued for the worker pool or the io_uring, which copy straight to
+	// the final offset; a sequential output has no offsets to go by
+	if ((mOptions.copyThreads > 1 || mOptions.ioUring) && !mOptions.pacedCopy && !mSequentialOutput && mBlockSize == 0) {
+		// one duplicate per source, the spans of a trim all share it
+		CopyRange range = { -1, posi, mOffset, size };
+		if (!mPendingCopies.empty() && src == mPendingSrc && srcName == mPendingSrcName) {
+			range.srcFD = mPendingCopies.back().srcFD;
+		}
+		else if ((range.srcFD = dup(src)) < 0) {
+			_E("dup source %s failed \n", srcName.c_str());
+			return -1;
+		}
+		mPendingSrc = src;
+		mPendingSrcName = srcName;
+		mPendingCopies.push_back(range);
+		mOffset += size;
+		return 0;
+	}
+
+	int ret;
+	if (mBlockSize > 0) {
+		ret = CloneFileData(src, posi, mFD, mOffset, size, mBlockSize, &mCopyPath);
+	}
+	else if (mOptions.pacedCopy) {
+		ret = CopyFileDataPaced(src, posi, mFD, mOffset, size, &mCopyPath);
+	}
+	else {
+		ret = CopyFileData(src, posi, mFD, size, &mCopyPath);
+	}
+	if (ret != 0) {
+		_E("copy %lld bytes from %s to %s failed (%s) \n", (long long)size, srcName.c_str(), mPath.c_str(), CopyPathName(mCopyPath));
+		return -1;
+	}
+	_I("copied %lld bytes from %s via %s \n", (long long)size, srcName.c_str(), CopyPathName(mCopyPath));
 
     mOffset += size;
 
     return 0;
 }
 
+/*
+ * Copy the media data queued by copyData() on the io_uring if asked for
+ * and there is one, in parallel otherwise, and leave the file position
+ * right behind it, where the output buffer continues.
+ */
+int
+MP4Rewriter::runPendingCopies()
+{
+    if (mPendingCopies.empty()) {
+        return 0;
+    }
+
+    off_t size = 0;
+    for (vector<CopyRange>::iterator it = mPendingCopies.begin(); it != mPendingCopies.end(); ++it) {
+        size += it->size;
+    }
+
+    int ret = 1;
+    if (mOptions.ioUring) {
+        ret = CopyFileRangesUring(mPendingCopies, mFD, mOptions.ioUringQueueDepth, mOptions.copyInFlightBytes, &mCopyPath);
+        if (ret == 0) {
+            _I("copied %lld bytes with queue depth %d via %s \n", (long long)size, mOptions.ioUringQueueDepth, CopyPathName(mCopyPath));
+        }
+    }
+    if (ret != 0) {
+        ret = CopyFileRangesParallel(mPendingCopies, mFD, mOptions.copyThreads, mOptions.copyInFlightBytes, &mCopyPath);
+        if (ret != 0) {
+            _E("copy %lld bytes to %s failed (%s) \n", (long long)size, mPath.c_str(), CopyPathName(mCopyPath));
+        }
+        else {
+            _I("copied %lld bytes with %d threads via %s \n", (long long)size, mOptions.copyThreads, CopyPathName(mCopyPath));
+        }
+    }
+
+    const CopyRange& last = mPendingCopies.back();
+    if (lseek(mFD, last.dstOffset + last.size, SEEK_SET) < 0) {
+        ret = -1;
+    }
+
+    // the ranges sharing a source are queued one after another
+    for (vector<CopyRange>::iterator it = mPendingCopies.begin(); it != mPendingCopies.end(); ++it) {
+        if (it + 1 == mPendingCopies.end() || (it + 1)->srcFD != it->srcFD) {
+            ::close(it->srcFD);
+        }
+    }
+    mPendingCopies.clear();
+
+    return ret;
+}
 
 int MP4Rewriter::write(MP4Info *mp4info)
 {
     mMP4Info = mp4info;
 
+    return writeLayout();
+}
+
+int MP4Rewriter::plan(MP4Info *mp4info, MP4Layout *layout)
+{
+    mMP4Info = mp4info;
+
+    return planLayout(layout);
+}
+
+/*
+ * With preallocate the output is laid out first, so the whole file can be
+ * reserved before the first byte goes out.
+ */
+int MP4Rewriter::writeLayout()
+{
+	MP4Layout planned;
+	if (mOptions.preallocate) {
+		if (planLayout(&planned) != 0) {
+			return -1;
+		}
+#ifdef __linux__
+		// a sink that cannot preallocate is fine, a full volume is not
+		if (fallocate(mFD, 0, 0, planned.totalSize) != 0 && (errno == ENOSPC || errno == EFBIG)) {
+			_E("no room for %lld bytes of %s \n", (long long)planned.totalSize, mPath.c_str());
+			return -1;
+		}
+#endif
+	}
+
+	MP4Layout layout;
+	int ret = writeBoxes(&layout);
+	if (ret == 0) {
+		ret = flush();
+	}
+
+	if (ret == 0 && mOptions.preallocate && layout.totalSize != planned.totalSize) {
+		_W("planned %lld bytes, wrote %lld \n", (long long)planned.totalSize, (long long)layout.totalSize);
+		// no reserved zeros behind the last box
+		if (layout.totalSize < planned.totalSize && !mSequentialOutput && ftruncate(mFD, layout.totalSize) != 0) {
+			_E("truncate %s to %lld bytes failed \n", mPath.c_str(), (long long)layout.totalSize);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Goes through writeBoxes() with copies skipped and the output buffer
+ * dropped instead of flushed. Only works before anything is written.
+ */
+int MP4Rewriter::planLayout(MP4Layout *layout)
+{
+	if (mOffset != 0) {
+		return -1;
+	}
+
+	// the block size open() would have taken from the output
+	struct stat st;
+	if (mOptions.reflink && mFD == -1) {
+		vector<char> path(mPath.begin(), mPath.end());
+		path.push_back('\0');
+		if (stat(dirname(&path[0]), &st) == 0) {
+			mBlockSize = st.st_blksize;
+		}
+	}
+
+	mDryRun = true;
+	int ret = writeBoxes(layout);
+	mDryRun = false;
+
+	mBuffer.clear();
+	mOffset = 0;
+
+	return ret;
+}
+
+int MP4Rewriter::writeBoxes(MP4Layout *layout)
+{
 	// write ftyp
+	layout->ftypOffset = mOffset;
 	writeFtypBox();
+	layout->ftypSize = mOffset - layout->ftypOffset;
+
+	// write moov up front for faststart and sequential output, at the end
+	// otherwise
+	if (hasLeadingMoov()) {
+		layout->moovOffset = mOffset;
+		writeLeadingMoovBox();
+		layout->moovSize = mOffset - layout->moovOffset;
+	}
+	else {
+		planMediaData(mOffset);
+	}
+
+	layout->freeOffset = mOffset;
+	layout->freeSize = mMediaDataPadding;
+	layout->mdatOffset = mOffset + mMediaDataPadding;
+	layout->mediaDataOffset = mMediaDataOffset;
+	layout->mdatSize = mMediaDataOffset - layout->mdatOffset + mMediaDataSize;
 
 	// write mdat
-	int32_t mdatLen = 8; // ....mdat
-	int32_t mediaDataSize = mp4info->trimCeaseOffset - mp4info->trimBeginOffset;
-	mdatLen += mediaDataSize;
-	writeInt32(mdatLen);
-	writeFourcc("mdat");
-	int srcFD = ::open(mp4info->mFilePath.c_str(), O_RDONLY);
-	copyData(srcFD, mp4info->trimBeginOffset, mediaDataSize, mp4info->mFilePath);
-    ::close(srcFD);
+	int ret = writeMediaData();
+	if (ret != 0) {
+		return ret;
+	}
+
+	if (!hasLeadingMoov()) {
+		layout->moovOffset = mOffset;
+		writeMoovBox();
+		layout->moovSize = mOffset - layout->moovOffset;
+	}
+
+	layout->totalSize = mOffset;
+	return 0;
+}
+
+/*
+ * Trimmed media data is the bytes of the trimmed samples, the ranges of
+ * both tracks merged where they touch, so audio chunks of other times and
+ * anything between chunks stay behind. For reflink it is one range of the
+ * source instead, behind a free box that block aligns it: cloned blocks
+ * cost no I/O, and a gap would throw the alignment off.
+ */
+void MP4Rewriter::planMediaData(off_t offset)
+{
+	uint64_t mediaDataSize = mMP4Info->trimCeaseOffset - mMP4Info->trimBeginOffset;
+	off_t padding = 0;
+	if (mBlockSize == 0 && (!mMediaSpans.empty() || planMediaSpans())) {
+		const MediaSpan& last = mMediaSpans.back();
+		mediaDataSize = last.mediaOffset + last.size;
+	}
+	else {
+		mMediaSpans.clear();
+		padding = alignmentPadding(offset + MdatHeaderSize(mediaDataSize), mMP4Info->trimBeginOffset);
+	}
+	setMediaDataLayout(offset, padding, mediaDataSize, false);
+}
+
+/*
+ * The bytes of the 0-based samples [begin, cease) of a track, one range
+ * per chunk, from the chunk that holds begin on; no per-sample table is
+ * built, only the sizes of the samples taken are summed.
+ */
+void MP4Rewriter::TrackMediaSpans(const TrackInfo *ti, stcoVectorIterator chunk, uint32_t begin, uint32_t cease, vector<MediaSpan> *spans)
+{
+	uint32_t sampleCount = ti->stsz.size();
+	cease = min(cease, sampleCount);
+	for (; chunk != ti->stco.end() && chunk->firstSampleIndex >= 0 && (uint32_t)chunk->firstSampleIndex < cease; ++chunk) {
+		// the fake end chunk of audio has no first sample
+		uint32_t first = chunk->firstSampleIndex;
+		uint32_t next = chunk + 1 != ti->stco.end() && (chunk + 1)->firstSampleIndex >= (int32_t)first
+		              ? min((uint32_t)(chunk + 1)->firstSampleIndex, sampleCount) : sampleCount;
+		MediaSpan span = { (off_t)chunk->chunkOffset, 0, 0 };
+		uint32_t i = first;
+		for (; i < begin && i < next; ++i) {
+			span.srcOffset += ti->stsz[i];
+		}
+		for (; i < next && i < cease; ++i) {
+			span.size += ti->stsz[i];
+		}
+		if (span.size > 0) {
+			spans->push_back(span);
+		}
+	}
+}
+
+bool MP4Rewriter::planMediaSpans()
+{
+	MP4Info *info = mMP4Info;
+	if (info->trimCeaseAudioID < info->trimBeginAudioID || info->trimCeaseVideoID < info->trimBeginVideoID) {
+		return false;
+	}
+	if (info->mVideoTrackInfo->mTablesDeferred || info->mAudioTrackInfo->mTablesDeferred) {
+		return false;
+	}
+
+	vector<MediaSpan> spans;
+	TrackMediaSpans(info->mVideoTrackInfo, info->trimBeginVideoChunk, info->trimBeginVideoID - 1, info->trimCeaseVideoID - 1, &spans);
+	TrackMediaSpans(info->mAudioTrackInfo, info->trimBeginAudioChunk, info->trimBeginAudioID - 1, info->trimCeaseAudioID - 1, &spans);
+	if (spans.empty()) {
+		return false;
+	}
+	sort(spans.begin(), spans.end(), compareMediaSpanSource);
+
+	mMediaSpans.clear();
+	for (vector<MediaSpan>::const_iterator it = spans.begin(); it != spans.end(); ++it) {
+		if (!mMediaSpans.empty() && it->srcOffset <= mMediaSpans.back().srcOffset + mMediaSpans.back().size) {
+			MediaSpan& last = mMediaSpans.back();
+			last.size = max(last.size, it->srcOffset + it->size - last.srcOffset);
+			continue;
+		}
+		MediaSpan span = *it;
+		span.mediaOffset = mMediaSpans.empty() ? 0 : mMediaSpans.back().mediaOffset + mMediaSpans.back().size;
+		mMediaSpans.push_back(span);
+	}
+
+	const MediaSpan& last = mMediaSpans.back();
+	_I("media data: %zu ranges, %lld of %lld bytes \n", mMediaSpans.size(), (long long)(last.mediaOffset + last.size),
+			(long long)(info->trimCeaseOffset - info->trimBeginOffset));
+	return true;
+}
+
+/*
+ * Where a source byte of the trimmed media data lands in the output.
+ */
+off_t MP4Rewriter::outputOffsetOf(off_t sourceOffset) const
+{
+	if (mMediaSpans.empty()) {
+		return mMediaDataOffset + sourceOffset - mMP4Info->trimBeginOffset;
+	}
+	MediaSpan key = { sourceOffset, 0, 0 };
+	vector<MediaSpan>::const_iterator it = upper_bound(mMediaSpans.begin(), mMediaSpans.end(), key, compareMediaSpanSource);
+	if (it != mMediaSpans.begin()) {
+		--it;
+	}
+	return mMediaDataOffset + it->mediaOffset + sourceOffset - it->srcOffset;
+}
+
+int MP4Rewriter::writeMediaData()
+{
+	writeMediaDataHeader();
+
+	int srcFD = ::open(mMP4Info->mFilePath.c_str(), O_RDONLY);
+	if (srcFD < 0) {
+		_E("open %s failed \n", mMP4Info->mFilePath.c_str());
+		return -1;
+	}
+	int ret = 0;
+	if (mMediaSpans.empty()) {
+		ret = copyData(srcFD, mMP4Info->trimBeginOffset, mMediaDataSize, mMP4Info->mFilePath);
+	}
+	for (vector<MediaSpan>::const_iterator it = mMediaSpans.begin(); it != mMediaSpans.end() && ret == 0; ++it) {
+		ret = copyData(srcFD, it->srcOffset, it->size, mMP4Info->mFilePath);
+	}
+	::close(srcFD);
+
+	// the queued copies run even after a failure, their fds go with them
+	int copied = runPendingCopies();
+	return ret != 0 ? ret : copied;
+}
+
+/*
+ * Where the media data goes when its free box starts at offset; a
+ * padding shorter than a box header is grown by a whole block, which
+ * keeps the alignment.
+ */
+void MP4Rewriter::setMediaDataLayout(off_t offset, off_t padding, uint64_t mediaDataSize, bool largeSize)
+{
+	if (padding > 0 && padding < 8) {
+		padding += mBlockSize;
+	}
+	mMediaDataPadding = padding;
+	mMediaDataSize = mediaDataSize;
+	mLargeMediaDataHeader = largeSize || MdatHeaderSize(mediaDataSize) == 16;
+	mMediaDataOffset = offset + padding + (mLargeMediaDataHeader ? 16 : 8);
+}
+
+void MP4Rewriter::writeMediaDataHeader()
+{
+	writeFreeBox(mMediaDataPadding);
+	writeMdatHeader(mMediaDataSize, mLargeMediaDataHeader);
+}
+
+/*
+ * The chunk offsets in a leading moov point past the moov itself, so it
+ * is serialized until its size settles, which takes a second round only
+ * when stco turns into co64. Each round replaces the previous one in the
+ * output buffer; nothing reaches the file before the last.
+ */
+void MP4Rewriter::writeLeadingMoovBox()
+{
+	size_t bufferStart = mBuffer.size();
+	off_t moovOffset = mOffset;
+	off_t moovSize = 0;
+
+	mHoldOutput = true;
+	for (;;) {
+		planMediaData(moovOffset + moovSize);
+		writeMoovBox();
+		if (mOffset - moovOffset == moovSize) {
+			break;
+		}
+		moovSize = mOffset - moovOffset;
+		mBuffer.resize(bufferStart);
+		mOffset = moovOffset;
+	}
+	mHoldOutput = false;
+	_I("faststart moov: %lld bytes at %lld \n", (long long)moovSize, (long long)moovOffset);
+}
+
+/*
+ * Serializes the moov into the output buffer and takes it back out again.
+ */
+off_t MP4Rewriter::measureMoovBox()
+{
+	size_t bufferStart = mBuffer.size();
+	off_t moovOffset = mOffset;
 
-	// write moov
+	mHoldOutput = true;
 	writeMoovBox();
+	mHoldOutput = false;
+
+	off_t moovSize = mOffset - moovOffset;
+	mBuffer.resize(bufferStart);
+	mOffset = moovOffset;
+	return moovSize;
+}
 
+int MP4Rewriter::seekOutput(off_t offset)
+{
+	if (flush() != 0 || lseek(mFD, offset, SEEK_SET) < 0) {
+		return -1;
+	}
+	mOffset = offset;
+	return 0;
+}
+
+int MP4Rewriter::truncateOutput(off_t size)
+{
+	if (flush() != 0 || ftruncate(mFD, size) != 0) {
+		return -1;
+	}
 	return 0;
 }
 
 size_t MP4Rewriter::write(const void* data, size_t size, size_t nmemb)
 {
 	size_t bytes = size * nmemb;
-	::write(mFD, data, bytes);
 	mOffset += bytes;
+	if (mError != 0) {
+		return 0;
+	}
+	const uint8_t *p = (const uint8_t *)data;
+	mBuffer.insert(mBuffer.end(), p, p + bytes);
+	// an open box stays in memory until its size is known
+	if (mBoxes.empty() && mBuffer.size() >= OUTPUT_BUFFER_SIZE) {
+		flush();
+	}
 	return bytes;
 }
 
@@ -175,9 +706,14 @@ void MP4Rewriter::writeCString(const char* str) {
 	write(str, 1, strlen(str) + 1);
 }
 
+/*
+ * Boxes are built in the output buffer, which is never flushed while one
+ * is open; endBox() fills in the size before any byte of the box leaves,
+ * so every box is written exactly once and in order.
+ */
 void MP4Rewriter::beginBox(const char *fourcc)
 {
-	BoxInfo bi = {mOffset, fourcc};
+	BoxInfo bi = {(off_t)mBuffer.size(), fourcc};
 	mBoxes.push_back(bi);
 
 	writeInt32(0);
@@ -186,15 +722,20 @@ void MP4Rewriter::beginBox(const char *fourcc)
 
 void MP4Rewriter::endBox()
 {
-	BoxInfo bi = *--mBoxes.end();
-	mBoxes.erase(--mBoxes.end());
+	BoxInfo bi = mBoxes.back();
+	mBoxes.pop_back();
+	if (mError != 0) {
+		return;
+	}
 
-    lseek(mFD, bi.offset, SEEK_SET);
-    int32_t boxSize = mOffset - bi.offset;
-    writeInt32(boxSize);
-    mOffset -= 4;
-    lseek(mFD, mOffset, SEEK_SET);
-    _I("box %s end with size %d - %08x; will seek to %lld \n", bi.name, boxSize, boxSize, mOffset);
+    int32_t boxSize = mBuffer.size() - bi.offset;
+    uint32_t field = htonl(boxSize);
+    memcpy(&mBuffer[bi.offset], &field, 4);
+    _I("box %s end with size %d - %08x \n", bi.name, boxSize, boxSize);
+
+    if (mBoxes.empty() && mBuffer.size() >= OUTPUT_BUFFER_SIZE) {
+        flush();
+    }
 }
 
 void MP4Rewriter::writeFtypBox()
@@ -207,6 +748,41 @@ void MP4Rewriter::writeFtypBox()
     endBox();
 }
 
+// a free box of padding bytes, none for 0
+void MP4Rewriter::writeFreeBox(off_t padding)
+{
+    if (padding == 0) {
+        return;
+    }
+    beginBox("free");
+    vector<uint8_t> zeros(padding - 8, 0);
+    write(zeros.data(), zeros.size());
+    endBox();
+}
+
+int MP4Rewriter::MdatHeaderSize(uint64_t mediaDataSize)
+{
+    return mediaDataSize + 8 > UINT32_MAX ? 16 : 8;
+}
+
+/*
+ * A 32-bit mdat header when the box fits, the 64-bit largesize form
+ * otherwise.
+ */
+void MP4Rewriter::writeMdatHeader(uint64_t mediaDataSize, bool largeSize)
+{
+    if (largeSize || MdatHeaderSize(mediaDataSize) == 16) {
+        writeInt32(1);
+        writeFourcc("mdat");
+        writeInt64(mediaDataSize + 16);
+    }
+    else {
+        writeInt32(mediaDataSize + 8);
+        writeFourcc("mdat");
+    }
+    mMediaDataOffset = mOffset;
+}
+
 void MP4Rewriter::writeMoovBox()
 {
     beginBox("moov");
@@ -224,6 +800,8 @@ void MP4Rewriter::writeMoovBox()
     beginAudioTrack();
     writeTrackInfo();
 #endif
+    writeMvexBox();
+
     endBox();
 }
 
@@ -245,7 +823,7 @@ void MP4Rewriter::writeMvhdBox()
     writeInt32(now);           // modification time
     writeInt32(getTimeScale());    // mvhd timescale
 
-    writeInt32(getDuration());
+    writeInt32(getPresentedDuration());
 
     writeInt32(0x10000);       // rate: 1.0
     writeInt16(0x100);         // volume
@@ -278,11 +856,12 @@ void MP4Rewriter::writeMvhdBox()
  * where a, b, c, d, x, and y is in 16.16 format, while
  * u, v and w is in 2.30 format.
  */
-void MP4Rewriter::writeCompositionMatrix(int degrees) {
+bool MP4Rewriter::CompositionMatrix(int degrees, uint32_t matrix[9]) {
     uint32_t a = 0x00010000;
     uint32_t b = 0;
     uint32_t c = 0;
     uint32_t d = 0x00010000;
+    bool known = true;
     switch (degrees) {
         case 0:
             break;
@@ -303,19 +882,30 @@ void MP4Rewriter::writeCompositionMatrix(int degrees) {
             d = 0;
             break;
         default:
-            _W("Should never reach this unknown rotation");
+            known = false;
             break;
     }
 
-    writeInt32(a);           // a
-    writeInt32(b);           // b
-    writeInt32(0);           // u
-    writeInt32(c);           // c
-    writeInt32(d);           // d
-    writeInt32(0);           // v
-    writeInt32(0);           // x
-    writeInt32(0);           // y
-    writeInt32(0x40000000);  // w
+    matrix[0] = a;           // a
+    matrix[1] = b;           // b
+    matrix[2] = 0;           // u
+    matrix[3] = c;           // c
+    matrix[4] = d;           // d
+    matrix[5] = 0;           // v
+    matrix[6] = 0;           // x
+    matrix[7] = 0;           // y
+    matrix[8] = 0x40000000;  // w
+    return known;
+}
+
+void MP4Rewriter::writeCompositionMatrix(int degrees) {
+    uint32_t matrix[9];
+    if (!CompositionMatrix(degrees, matrix)) {
+        _W("Should never reach this unknown rotation");
+    }
+    for (int i = 0; i < 9; i++) {
+        writeInt32(matrix[i]);
+    }
 }
 
 void MP4Rewriter::writeTrackInfo()
@@ -325,6 +915,9 @@ void MP4Rewriter::writeTrackInfo()
     beginBox("trak");
     {
         writeTkhdBox(now);
+        if (hasEditList()) {
+            writeEdtsBox();
+        }
         beginBox("mdia");
         {
             writeMdhdBox(now);
@@ -357,7 +950,7 @@ void MP4Rewriter::writeTkhdBox(uint32_t now)
     writeInt32(getTrackID());
     writeInt32(0);             // reserved
 
-    writeInt32(getDuration());             // duration, in mvhd timescale
+    writeInt32(getPresentedDuration());    // duration, in mvhd timescale
 
     writeInt32(0);             // reserved
     writeInt32(0);             // reserved
@@ -382,6 +975,57 @@ void MP4Rewriter::writeTkhdBox(uint32_t now)
     endBox();
 }
 
+int64_t MP4Rewriter::getLeadIn(bool video)
+{
+    if (!mOptions.editList) {
+        return 0;
+    }
+    return video ? mMP4Info->trimVideoLeadIn : mMP4Info->trimAudioLeadIn;
+}
+
+int32_t MP4Rewriter::getPresentedDuration()
+{
+    int64_t leadIn = getLeadIn(true);
+    if (leadIn == 0) {
+        return getDuration();
+    }
+    return getDuration() - (leadIn * getTimeScale() + mMP4Info->mVideoTrackInfo->timeScale / 2) / mMP4Info->mVideoTrackInfo->timeScale;
+}
+
+/*
+ * One edit that skips the lead-in of the track, behind an empty edit for
+ * as long as the track starts late.
+ */
+void MP4Rewriter::writeEdtsBox()
+{
+    int64_t leadIn = getLeadIn(mIsWritingVideoTrack);
+    int32_t duration = getPresentedDuration();
+    int32_t delay = 0;
+    if (leadIn < 0) {
+        delay = min<int64_t>((-leadIn * getTimeScale() + getTrackTimeScale() / 2) / getTrackTimeScale(), duration);
+        leadIn = 0;
+    }
+
+    beginBox("edts");
+    {
+        beginBox("elst");
+        {
+            writeInt32(0);              // version=0, flags=0
+            writeInt32(delay > 0 ? 2 : 1); // entry count
+            if (delay > 0) {
+                writeInt32(delay);      // segment duration, in mvhd timescale
+                writeInt32(-1);         // media time: none, an empty edit
+                writeInt32(0x10000);    // media rate: 1.0
+            }
+            writeInt32(duration - delay);
+            writeInt32(leadIn);         // media time, in the track timescale
+            writeInt32(0x10000);
+        }
+        endBox();
+    }
+    endBox();
+}
+
 void MP4Rewriter::writeMdhdBox(uint32_t now)
 {
     beginBox("mdhd");
@@ -480,150 +1124,13 @@ int MP4Rewriter::writeStblBox()
         // int32_t sampleCount = getSampleCount();
 
         // stts
-        beginBox("stts");   // sample duration
-        {
-            writeInt32(0);      // version=0, flags=0
-
-            decltype(mMP4Info->mVideoTrackInfo->stts)* stts = nullptr;
-            decltype(mMP4Info->trimBeginVideoID) id;
-
-            if (mIsWritingVideoTrack) {
-                stts = &mMP4Info->mVideoTrackInfo->stts;
-                id = mMP4Info->trimBeginVideoID;
-            }
-            else {
-                stts = &mMP4Info->mAudioTrackInfo->stts;
-                id = mMP4Info->trimBeginAudioID;
-            }
+        int err = writeSttsBox();
+        if (err != 0) {
+            return err;
+        }
 
-            auto it = stts->begin();
-            while (id > it->count && it != stts->end()) {
-                id -= it->count;
-                ++it;
-            }
-            if (it == stts->end()) {
-                _E("UGLY BAD %s stts data! \n", (mIsWritingVideoTrack ? "video" : "audio"));
-                return -9527;
-            }
-
-            auto yaid = getSampleCount() + id;
-            auto yait = it;
-
-            while (yaid > yait->count && yait != stts->end()) {
-                yaid -= yait->count;
-                ++yait;
-            }
-            if (yait == stts->end()) {
-                _E("UGLY BAD %s stts data! \n", (mIsWritingVideoTrack ? "video" : "audio"));
-                return -19527;
-            }
-
-            if (it < yait) {
-                writeInt32(yait - it + ((it->count - id > 1) ? 2 : 1)); // ?
-                writeInt32(1);
-                writeInt32(it->delta);
-
-                if (it->count - id > 1) {
-                    writeInt32(it->count - id - 1);
-                    writeInt32(it->delta);
-                }
-                for (++it; it < yait; ++it) {
-                    writeInt32(it->count);
-                    writeInt32(it->delta);
-                }
-                writeInt32(yaid);
-                writeInt32(yait->delta);
-            }
-            else {
-                // TODO if yaid - id - 1 == 0
-                writeInt32(2);
-                writeInt32(1);
-                writeInt32(it->delta);
-                writeInt32(yaid - id - 1);
-                writeInt32(it->delta);
-            }
-
-#if 0
-            writeInt32(2);      //
-            int32_t sampleDelta = getSampleDelta();
-            writeInt32(1);
-            writeInt32(sampleDelta);
-            writeInt32(sampleCount - 1);
-            writeInt32(sampleDelta);
-#endif
-        }
-        endBox();
-#if 0
-        if (mTrackInfo->mIsVideo) {
-            writeInt32(1);
-            writeInt32(5000);   // TODO
-            writeInt32(videoSampleCount - 1);
-            writeInt32(5000);   // TODO
-        }
-        else {
-            writeInt32(1);
-            writeInt32(1024);   // TODO
-            writeInt32(audioSampleCount - 1);
-            writeInt32(1024);   // TODO
-        }
-        endBox();
-#endif
-
-        // ctts
-        if (mIsWritingVideoTrack && mMP4Info->mVideoTrackInfo->ctts.size()) {
-            auto& ctts = mMP4Info->mVideoTrackInfo->ctts;
-
-            beginBox("ctts");
-            {
-                auto accu = 0;
-                auto it = ctts.begin();
-
-                for (; accu + it->count < mMP4Info->trimBeginVideoID; ++it, accu += it->count) {}
-                auto bit = it;
-                auto baccu = accu;
-
-                for (; accu + it->count < mMP4Info->trimCeaseVideoID; ++it, accu += it->count) {}
-                auto cit = it;
-                auto caccu = accu;
-
-                int32_t count = 0;
-                if (bit != cit) {
-                    count += cit - bit;
-                    if (baccu + bit->count - mMP4Info->trimBeginVideoID > 0) {
-                        count += 2;
-                    }
-                    else {
-                        count += 1;
-                    }
-                }
-                else {
-                    count = 2;
-                }
-
-
-                writeInt32(0); // version=0, flags=0
-
-                writeInt32(count);
-
-                writeInt32(1);
-                writeInt32(10000);
-
-                if (baccu + bit->count - mMP4Info->trimBeginVideoID > 0) {
-                    writeInt32(baccu + bit->count - mMP4Info->trimBeginVideoID);
-                    writeInt32(bit->delta);
-                }
-
-                for (++bit; bit < cit; ++bit) {
-                    writeInt32(bit->count);
-                    writeInt32(bit->delta);
-                }
-
-                writeInt32(mMP4Info->trimCeaseVideoID - caccu);
-                writeInt32(cit->delta);
-
-            }
-            endBox();
-        }
+        // ctts
+        writeCttsBox();
 
         // stss
 #if 1
@@ -673,143 +1180,7 @@ int MP4Rewriter::writeStblBox()
 #endif
 
         // stsc samplt to chunk
-        beginBox("stsc");
-        {
-            writeInt32(0);          // version=0, flags=0
-
-            decltype(mMP4Info->mVideoTrackInfo) trackInfo = nullptr;
-
-            decltype(mMP4Info->trimBeginVideoChunk)* trimBeginChunk = nullptr;
-            decltype(mMP4Info->trimCeaseVideoChunk)* trimCeaseChunk = nullptr;
-
-            decltype(mMP4Info->trimBeginVideoID) trimBeginID;
-            decltype(mMP4Info->trimCeaseVideoID) trimCeaseID;
-
-            if (mIsWritingVideoTrack) {
-                trackInfo = mMP4Info->mVideoTrackInfo;
-                trimBeginChunk = &mMP4Info->trimBeginVideoChunk;
-                trimCeaseChunk = &mMP4Info->trimCeaseVideoChunk;
-                trimBeginID = mMP4Info->trimBeginVideoID;
-                trimCeaseID = mMP4Info->trimCeaseVideoID;
-            }
-            else {
-                trackInfo = mMP4Info->mAudioTrackInfo;
-                trimBeginChunk = &mMP4Info->trimBeginAudioChunk;
-                trimCeaseChunk = &mMP4Info->trimCeaseAudioChunk;
-                trimBeginID = mMP4Info->trimBeginAudioID;
-                trimCeaseID = mMP4Info->trimCeaseAudioID;
-            }
-
-            {
-                auto bit = upper_bound(
-                            trackInfo->stsc.begin(),
-                            trackInfo->stsc.end(),
-                            (*trimBeginChunk) - trackInfo->stco.begin() + 1,
-                            compareStscChunkIndex);
-                --bit;
-                auto cit = upper_bound(
-                            trackInfo->stsc.begin(),
-                            trackInfo->stsc.end(),
-                            (*trimCeaseChunk) - trackInfo->stco.begin() + 1,
-                            compareStscChunkIndex);
-                --cit;
-
-                if (bit == cit) {
-                    if ((*trimCeaseChunk) == (*trimBeginChunk)) {
-                        writeInt32(1); // count
-
-                        writeInt32(1); // first chunk
-                        writeInt32(trimCeaseID - trimBeginID + 1);
-                        writeInt32(1);
-                    }
-                    else {
-                        writeInt32(2 + ((trimCeaseID - trimBeginID > 1) ? 1 : 0));
-
-                        //
-                        writeInt32(1); // first chunk
-                        writeInt32(bit->samplesPerChunk - (trimBeginID - (*trimBeginChunk)->firstSampleIndex) + 1); // TODO
-                        writeInt32(1);
-
-                        if (trimCeaseID - trimBeginID > 1) {
-                            writeInt32(2); // begin chunk id
-                            //writeInt32((*trimCeaseChunk) - (*trimBeginChunk) - 1);
-                            writeInt32(bit->samplesPerChunk);
-                            writeInt32(1);
-                        }
-
-                        // mMP4Info->trimCeaseVideoChunk
-                        writeInt32((*trimCeaseChunk) - (*trimBeginChunk) + 1); // last chunk
-                        writeInt32(trimCeaseID - 1 - (*trimCeaseChunk)->firstSampleIndex);
-                        writeInt32(1);
-                    }
-                }
-                else {
-                    int32_t const chunkIndexOffset = (*trimBeginChunk) - trackInfo->stco.begin();
-
-                    int32_t count = cit - bit + 1;
-                    if ((*trimBeginChunk) - trackInfo->stco.begin() + 2 < (bit + 1)->firstChunkIndex) {
-                        count += 1;
-                    }
-                    if ((*trimCeaseChunk) - trackInfo->stco.begin() + 1 > cit->firstChunkIndex) {
-                        count += 1;
-                    }
-                    if (trimCeaseID - 1 - (*trimCeaseChunk)->firstSampleIndex <= 0) {
-                        count -= 1;
-                    }
-                    writeInt32(count);
-
-                    writeInt32(1);
-                    writeInt32(bit->samplesPerChunk - (trimBeginID - 1 - (*trimBeginChunk)->firstSampleIndex));
-                    writeInt32(1);
-
-                    if ((*trimBeginChunk) - trackInfo->stco.begin() + 2 < (bit + 1)->firstChunkIndex) {
-                        writeInt32(2);
-                        writeInt32(bit->samplesPerChunk);
-                        writeInt32(1);
-                    }
-
-                    for (auto it = bit + 1; it < cit; ++it) {
-                        writeInt32(it->firstChunkIndex - chunkIndexOffset);
-                        writeInt32(it->samplesPerChunk);
-                        writeInt32(1);
-                    }
-
-                    if ((*trimCeaseChunk) - trackInfo->stco.begin() + 1 > cit->firstChunkIndex) {
-                        writeInt32(cit->firstChunkIndex - chunkIndexOffset);
-                        writeInt32(cit->samplesPerChunk);
-                        writeInt32(1);
-                    }
-
-                    if (trimCeaseID - 1 - (*trimCeaseChunk)->firstSampleIndex > 0) {
-                        writeInt32((*trimCeaseChunk) - (*trimBeginChunk) + 1);
-                        writeInt32(trimCeaseID - 1 - (*trimCeaseChunk)->firstSampleIndex);
-                        writeInt32(1);
-                    }
-                }
-
-#if 0
-                auto it = stsc.begin();
-                if (it == stsc.end()) {
-                    _E("mal stsc data!\n");
-                    return -29527;
-                }
-                auto nit = it + 1;
-                auto c = 0;
-                for (; it != stsc.end(); ++it) {
-                    if (c + it->samplesPerChunk * ((it + 1)->))
-                    c += it->samplesPerChunk;
-                }
-#endif
-            }
-
-            // writeInt32(sampleCount);
-            // for (int i = 1; i <= sampleCount; ++i) {
-            //     writeInt32(i);
-            //     writeInt32(1);
-            //     writeInt32(1);
-            // }
-        }
-        endBox();
+        writeStscBox();
 
         // stco
 #if 1
@@ -904,6 +1275,272 @@ void MP4Rewriter::writeAudioFourCCBox()
     endBox();
 }
 
+int MP4Rewriter::writeSttsBox()
+{
+    beginBox("stts");   // sample duration
+    {
+        writeInt32(0);      // version=0, flags=0
+
+        decltype(mMP4Info->mVideoTrackInfo->stts)* stts = nullptr;
+        decltype(mMP4Info->trimBeginVideoID) id;
+
+        if (mIsWritingVideoTrack) {
+            stts = &mMP4Info->mVideoTrackInfo->stts;
+            id = mMP4Info->trimBeginVideoID;
+        }
+        else {
+            stts = &mMP4Info->mAudioTrackInfo->stts;
+            id = mMP4Info->trimBeginAudioID;
+        }
+
+        auto it = stts->begin();
+        while (it != stts->end() && id > it->count) {
+            id -= it->count;
+            ++it;
+        }
+        if (it == stts->end()) {
+            _E("UGLY BAD %s stts data! \n", (mIsWritingVideoTrack ? "video" : "audio"));
+            return -9527;
+        }
+
+        // the runs over exactly the trimmed samples, which may end on the
+        // last one, the first sample in a run of its own
+        vector<sttsEntry> runs;
+        int32_t left = getSampleCount();
+        int32_t room = it->count - id + 1;
+        for (bool first = true; left > 0; first = false) {
+            if (room == 0) {
+                if (++it == stts->end()) {
+                    _E("UGLY BAD %s stts data! \n", (mIsWritingVideoTrack ? "video" : "audio"));
+                    return -19527;
+                }
+                room = it->count;
+            }
+            sttsEntry run = { first ? 1 : min(room, left), it->delta };
+            runs.push_back(run);
+            left -= run.count;
+            room -= run.count;
+        }
+
+        writeInt32(runs.size());
+        for (vector<sttsEntry>::const_iterator run = runs.begin(); run != runs.end(); ++run) {
+            writeInt32(run->count);
+            writeInt32(run->delta);
+        }
+
+#if 0
+        writeInt32(2);      //
+        int32_t sampleDelta = getSampleDelta();
+        writeInt32(1);
+        writeInt32(sampleDelta);
+        writeInt32(sampleCount - 1);
+        writeInt32(sampleDelta);
+#endif
+    }
+    endBox();
+#if 0
+    if (mTrackInfo->mIsVideo) {
+        writeInt32(1);
+        writeInt32(5000);   // TODO
+        writeInt32(videoSampleCount - 1);
+        writeInt32(5000);   // TODO
+    }
+    else {
+        writeInt32(1);
+        writeInt32(1024);   // TODO
+        writeInt32(audioSampleCount - 1);
+        writeInt32(1024);   // TODO
+    }
+    endBox();
+#endif
+
+    return 0;
+}
+
+// the ctts runs of the 0-based samples [begin, cease) of source, merged
+// into the last run of out where the offsets match
+static void
+AppendCttsRange(const vector<cttsEntry>& source, uint32_t begin, uint32_t cease, vector<cttsEntry>& out)
+{
+    uint32_t first = 0;
+    for (vector<cttsEntry>::const_iterator it = source.begin(); it != source.end() && first < cease; first += it->count, ++it) {
+        uint32_t b = max(first, begin);
+        uint32_t c = min(first + it->count, cease);
+        if (b >= c) {
+            continue;
+        }
+        if (!out.empty() && out.back().delta == it->delta) {
+            out.back().count += c - b;
+        }
+        else {
+            cttsEntry entry = {(int32_t)(c - b), it->delta};
+            out.push_back(entry);
+        }
+    }
+}
+
+// the source offsets of the trimmed samples, as they are
+void MP4Rewriter::writeCttsBox()
+{
+    const vector<cttsEntry>& source = mMP4Info->mVideoTrackInfo->ctts;
+    if (!mIsWritingVideoTrack || source.empty()) {
+        return;
+    }
+
+    vector<cttsEntry> ctts;
+    AppendCttsRange(source, mMP4Info->trimBeginVideoID - 1, mMP4Info->trimCeaseVideoID - 1, ctts);
+
+    beginBox("ctts");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(ctts.size());
+    for (vector<cttsEntry>::iterator i = ctts.begin(); i != ctts.end(); ++i) {
+        writeInt32(i->count);
+        writeInt32(i->delta);
+    }
+    endBox();
+}
+
+void MP4Rewriter::writeStscBox()
+{
+    beginBox("stsc");
+    {
+        writeInt32(0);          // version=0, flags=0
+
+        decltype(mMP4Info->mVideoTrackInfo) trackInfo = nullptr;
+
+        decltype(mMP4Info->trimBeginVideoChunk)* trimBeginChunk = nullptr;
+        decltype(mMP4Info->trimCeaseVideoChunk)* trimCeaseChunk = nullptr;
+
+        decltype(mMP4Info->trimBeginVideoID) trimBeginID;
+        decltype(mMP4Info->trimCeaseVideoID) trimCeaseID;
+
+        if (mIsWritingVideoTrack) {
+            trackInfo = mMP4Info->mVideoTrackInfo;
+            trimBeginChunk = &mMP4Info->trimBeginVideoChunk;
+            trimCeaseChunk = &mMP4Info->trimCeaseVideoChunk;
+            trimBeginID = mMP4Info->trimBeginVideoID;
+            trimCeaseID = mMP4Info->trimCeaseVideoID;
+        }
+        else {
+            trackInfo = mMP4Info->mAudioTrackInfo;
+            trimBeginChunk = &mMP4Info->trimBeginAudioChunk;
+            trimCeaseChunk = &mMP4Info->trimCeaseAudioChunk;
+            trimBeginID = mMP4Info->trimBeginAudioID;
+            trimCeaseID = mMP4Info->trimCeaseAudioID;
+        }
+
+        {
+            auto bit = upper_bound(
+                        trackInfo->stsc.begin(),
+                        trackInfo->stsc.end(),
+                        (*trimBeginChunk) - trackInfo->stco.begin() + 1,
+                        compareStscChunkIndex);
+            --bit;
+            auto cit = upper_bound(
+                        trackInfo->stsc.begin(),
+                        trackInfo->stsc.end(),
+                        (*trimCeaseChunk) - trackInfo->stco.begin() + 1,
+                        compareStscChunkIndex);
+            --cit;
+
+            if (bit == cit) {
+                if ((*trimCeaseChunk) == (*trimBeginChunk)) {
+                    writeInt32(1); // count
+
+                    writeInt32(1); // first chunk
+                    writeInt32(trimCeaseID - trimBeginID + 1);
+                    writeInt32(1);
+                }
+                else {
+                    writeInt32(2 + ((trimCeaseID - trimBeginID > 1) ? 1 : 0));
+
+                    //
+                    writeInt32(1); // first chunk
+                    writeInt32(bit->samplesPerChunk - (trimBeginID - (*trimBeginChunk)->firstSampleIndex) + 1); // TODO
+                    writeInt32(1);
+
+                    if (trimCeaseID - trimBeginID > 1) {
+                        writeInt32(2); // begin chunk id
+                        //writeInt32((*trimCeaseChunk) - (*trimBeginChunk) - 1);
+                        writeInt32(bit->samplesPerChunk);
+                        writeInt32(1);
+                    }
+
+                    // mMP4Info->trimCeaseVideoChunk
+                    writeInt32((*trimCeaseChunk) - (*trimBeginChunk) + 1); // last chunk
+                    writeInt32(trimCeaseID - 1 - (*trimCeaseChunk)->firstSampleIndex);
+                    writeInt32(1);
+                }
+            }
+            else {
+                int32_t const chunkIndexOffset = (*trimBeginChunk) - trackInfo->stco.begin();
+
+                int32_t count = cit - bit + 1;
+                if ((*trimBeginChunk) - trackInfo->stco.begin() + 2 < (bit + 1)->firstChunkIndex) {
+                    count += 1;
+                }
+                if ((*trimCeaseChunk) - trackInfo->stco.begin() + 1 > cit->firstChunkIndex) {
+                    count += 1;
+                }
+                if (trimCeaseID - 1 - (*trimCeaseChunk)->firstSampleIndex <= 0) {
+                    count -= 1;
+                }
+                writeInt32(count);
+
+                writeInt32(1);
+                writeInt32(bit->samplesPerChunk - (trimBeginID - 1 - (*trimBeginChunk)->firstSampleIndex));
+                writeInt32(1);
+
+                if ((*trimBeginChunk) - trackInfo->stco.begin() + 2 < (bit + 1)->firstChunkIndex) {
+                    writeInt32(2);
+                    writeInt32(bit->samplesPerChunk);
+                    writeInt32(1);
+                }
+
+                for (auto it = bit + 1; it < cit; ++it) {
+                    writeInt32(it->firstChunkIndex - chunkIndexOffset);
+                    writeInt32(it->samplesPerChunk);
+                    writeInt32(1);
+                }
+
+                if ((*trimCeaseChunk) - trackInfo->stco.begin() + 1 > cit->firstChunkIndex) {
+                    writeInt32(cit->firstChunkIndex - chunkIndexOffset);
+                    writeInt32(cit->samplesPerChunk);
+                    writeInt32(1);
+                }
+
+                if (trimCeaseID - 1 - (*trimCeaseChunk)->firstSampleIndex > 0) {
+                    writeInt32((*trimCeaseChunk) - (*trimBeginChunk) + 1);
+                    writeInt32(trimCeaseID - 1 - (*trimCeaseChunk)->firstSampleIndex);
+                    writeInt32(1);
+                }
+            }
+
+#if 0
+            auto it = stsc.begin();
+            if (it == stsc.end()) {
+                _E("mal stsc data!\n");
+                return -29527;
+            }
+            auto nit = it + 1;
+            auto c = 0;
+            for (; it != stsc.end(); ++it) {
+                if (c + it->samplesPerChunk * ((it + 1)->))
+                c += it->samplesPerChunk;
+            }
+#endif
+        }
+
+        // writeInt32(sampleCount);
+        // for (int i = 1; i <= sampleCount; ++i) {
+        //     writeInt32(i);
+        //     writeInt32(1);
+        //     writeInt32(1);
+        // }
+    }
+    endBox();
+}
+
 void MP4Rewriter::writeStssBox()
 {
     if (mIsWritingVideoTrack) {
@@ -952,52 +1589,68 @@ void MP4Rewriter::writeStszBox()
 
 void MP4Rewriter::writeStcoBox()
 {
-    beginBox("stco");
-    writeInt32(0);          // version=0, flags=0
+    vector<uint64_t> offsets;
 
-    mMP4Info->postTrimMediaDataOffset = 32; // so far so good
-    mMP4Info->postTrimFirstVideoOffset = mMP4Info->postTrimMediaDataOffset;
-    // mMP4Info->postTrimFirstAudioOffset = mMP4Info->postTrimFirstVideoOffset + mMP4Info->mVideoTrackInfo->stsz[mMP4Info->trimBeginVideoID - 1];
-    // mMP4Info->trimBeginVideoChunk->firstSampleIndex;
+    mMP4Info->postTrimMediaDataOffset = mMediaDataOffset;
 
     if (mIsWritingVideoTrack) {
-        writeInt32(mMP4Info->trimCeaseVideoChunk - mMP4Info->trimBeginVideoChunk);
-
-        auto it = mMP4Info->trimBeginVideoChunk;
-        writeInt32(mMP4Info->postTrimFirstVideoOffset);
-
-        if (it + 1 != mMP4Info->trimCeaseVideoChunk) {
-            auto distance = it->chunkOffset - mMP4Info->postTrimFirstVideoOffset;
-            auto fix = 0;
-            for (auto i = mMP4Info->trimBeginVideoChunk->firstSampleIndex; i < mMP4Info->trimBeginVideoID - 1; ++i) {
-                fix += mMP4Info->mVideoTrackInfo->stsz[i];
-            }
-            distance += fix;
-            for (++it; it != mMP4Info->trimCeaseVideoChunk; ++it) {
-                writeInt32(it->chunkOffset - distance);
-            }
+        // the first chunk starts at the first video sample, partway if
+        // need be; audio may come before it
+        off_t begin = mMP4Info->trimBeginVideoChunk->chunkOffset;
+        for (int32_t i = mMP4Info->trimBeginVideoChunk->firstSampleIndex; i < mMP4Info->trimBeginVideoID - 1; ++i) {
+            begin += mMP4Info->mVideoTrackInfo->stsz[i];
         }
-
+        offsets.push_back(outputOffsetOf(begin));
+        for (auto it = mMP4Info->trimBeginVideoChunk + 1; it < mMP4Info->trimCeaseVideoChunk; ++it) {
+            offsets.push_back(outputOffsetOf(it->chunkOffset));
+        }
+        mMP4Info->postTrimFirstVideoOffset = offsets.front();
     } else {
-        mMP4Info->postTrimFirstAudioOffset = mMP4Info->postTrimFirstVideoOffset;
-        mMP4Info->postTrimFirstAudioOffset += mMP4Info->trimBeginAudioChunk->chunkOffset - mMP4Info->trimBeginVideoChunk->chunkOffset;
-        for (auto i = mMP4Info->trimBeginVideoChunk->firstSampleIndex; i < mMP4Info->trimBeginVideoID - 1; ++i) {
-            mMP4Info->postTrimFirstAudioOffset -= mMP4Info->mVideoTrackInfo->stsz[i];
+        for (auto it = mMP4Info->trimBeginAudioChunk; it < mMP4Info->trimCeaseAudioChunk; ++it) {
+            offsets.push_back(outputOffsetOf(it->chunkOffset));
+        }
+        if (!offsets.empty()) {
+            mMP4Info->postTrimFirstAudioOffset = offsets.front();
         }
+    }
 
-        writeInt32(mMP4Info->trimCeaseAudioChunk - mMP4Info->trimBeginAudioChunk);
-        //TrackInfo *trackInfo = mMP4Info->mAudioTrackInfo;
+    writeChunkOffsetBox(offsets);
+}
 
-        auto distance = mMP4Info->trimBeginAudioChunk->chunkOffset - mMP4Info->postTrimFirstAudioOffset;;
+/*
+ * stco while every offset fits in 32 bits, co64 as soon as one does not.
+ */
+void MP4Rewriter::writeChunkOffsetBox(const vector<uint64_t>& offsets)
+{
+    bool co64 = !offsets.empty() && *max_element(offsets.begin(), offsets.end()) > UINT32_MAX;
 
-        auto it = mMP4Info->trimBeginAudioChunk;
-        writeInt32(it->chunkOffset - distance);
-        for (++it; it < mMP4Info->trimCeaseAudioChunk; ++it) {
-            writeInt32(it->chunkOffset - distance);
+    beginBox(co64 ? "co64" : "stco");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(offsets.size());
+    for (vector<uint64_t>::const_iterator it = offsets.begin(); it != offsets.end(); ++it) {
+        if (co64) {
+            writeInt64(*it);
         }
+        else {
+            writeInt32(*it);
+        }
+    }
+    endBox();
+}
 
+void MP4Rewriter::SampleRuns(const CompactSampleTable& table, uint32_t begin, uint32_t cease, vector<SampleRun> *runs)
+{
+    runs->clear();
+    uint64_t next = 0;
+    for (uint32_t i = begin; i < cease; ++i) {
+        uint64_t offset = table.sampleOffset(i);
+        if (runs->empty() || offset != next) {
+            SampleRun run = { i, 0 };
+            runs->push_back(run);
+        }
+        ++runs->back().sampleCount;
+        next = offset + table.sampleSize(i);
     }
-    endBox();    
 }
 
 
@@ -1016,39 +1669,185 @@ MP4CatRewriter::write(CatTask * catTask)
 {
     mCatTask = catTask;
 
-    writeFtypBox();
-
-    // write mdat
-    beginBox("mdat");
-    for (list<MP4Info*>::iterator it = catTask->mInfoList.begin(); it != catTask->mInfoList.end(); ++it) {
-        MP4Info *mp4info = *it;
-        int srcFD = ::open(mp4info->mFilePath.c_str(), O_RDONLY);
-        copyData(srcFD, mp4info->mdatOffset + 8, mp4info->mdatSize - 8, mp4info->mFilePath);
-        ::close(srcFD);
-    }
-    endBox();
+    return writeLayout();
+}
 
-    // write moov
-    writeMoovBox();
+int
+MP4CatRewriter::plan(CatTask * catTask, MP4Layout *layout)
+{
+    mCatTask = catTask;
 
-    return 0;
+    return planLayout(layout);
 }
 
+/*
+ * For reflink every source is preceded by the zeros that put it on the
+ * same block offsets as in its own file, which moves the media data and
+ * may in turn need the 64-bit mdat header.
+ */
 void
-MP4CatRewriter::writeStssBox()
+MP4CatRewriter::planMediaData(off_t offset)
 {
-    if (isWritingVideoTrack()) {
-        beginBox("stss");
-        writeInt32(0);      // version=0, falgs=0
-
-        int32_t stssEntryCount = 0;
+    uint64_t mediaDataSize = 0;
+    bool largeSize = false;
+    for (int pass = 0; pass < 2; ++pass) {
+        off_t mediaData = offset + (largeSize ? 16 : 8);
+        mediaDataSize = 0;
+        mSourceMediaOffsets.clear();
         for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it) {
-            stssEntryCount += (*it)->mVideoTrackInfo->stss.size();
+            mediaDataSize += alignmentPadding(mediaData + mediaDataSize, (*it)->mdatOffset + (*it)->mdatHeaderSize);
+            mSourceMediaOffsets.push_back(mediaDataSize);
+            mediaDataSize += (*it)->mdatSize - (*it)->mdatHeaderSize;
         }
-        writeInt32(stssEntryCount);
+        if (largeSize || MdatHeaderSize(mediaDataSize) == 8) {
+            break;
+        }
+        largeSize = true;
+    }
+    setMediaDataLayout(offset, 0, mediaDataSize, largeSize);
+}
 
-        int32_t off = 0;
-        for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it) {
+int
+MP4CatRewriter::writeMediaData()
+{
+    writeMediaDataHeader();
+
+    int ret = 0;
+    int k = 0;
+    for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end() && ret == 0; ++it, ++k) {
+        MP4Info *mp4info = *it;
+        vector<uint8_t> zeros(mSourceMediaOffsets[k] - (getOffset() - getMediaDataOffset()), 0);
+        MP4Rewriter::write(zeros.data(), zeros.size());
+
+        int srcFD = ::open(mp4info->mFilePath.c_str(), O_RDONLY);
+        if (srcFD < 0) {
+            _E("open %s failed \n", mp4info->mFilePath.c_str());
+            ret = -1;
+            break;
+        }
+        ret = copyData(srcFD, mp4info->mdatOffset + mp4info->mdatHeaderSize, mp4info->mdatSize - mp4info->mdatHeaderSize, mp4info->mFilePath);
+        ::close(srcFD);
+    }
+
+    // all sources at once when copying in parallel
+    int copied = runPendingCopies();
+    return ret != 0 ? ret : copied;
+}
+
+static TrackInfo*
+CatTrackInfo(MP4Info *mp4info, bool video)
+{
+    return video ? mp4info->mVideoTrackInfo : mp4info->mAudioTrackInfo;
+}
+
+int
+MP4CatRewriter::writeSttsBox()
+{
+    vector<sttsEntry> stts;
+    for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it) {
+        TrackInfo *trackInfo = CatTrackInfo(*it, isWritingVideoTrack());
+        for (vector<sttsEntry>::iterator i = trackInfo->stts.begin(); i != trackInfo->stts.end(); ++i) {
+            if (!stts.empty() && stts.back().delta == i->delta) {
+                stts.back().count += i->count;
+            }
+            else {
+                stts.push_back(*i);
+            }
+        }
+    }
+
+    beginBox("stts");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(stts.size());
+    for (vector<sttsEntry>::iterator i = stts.begin(); i != stts.end(); ++i) {
+        writeInt32(i->count);
+        writeInt32(i->delta);
+    }
+    endBox();
+
+    return 0;
+}
+
+void
+MP4CatRewriter::writeCttsBox()
+{
+    if (!isWritingVideoTrack()) {
+        return;
+    }
+
+    bool hasCtts = false;
+    for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it) {
+        hasCtts = hasCtts || !(*it)->mVideoTrackInfo->ctts.empty();
+    }
+    if (!hasCtts) {
+        return;
+    }
+
+    vector<cttsEntry> ctts;
+    for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it) {
+        TrackInfo *trackInfo = (*it)->mVideoTrackInfo;
+        if (trackInfo->ctts.empty()) {
+            // a source without ctts has composition == decode time
+            cttsEntry entry = {(int32_t)trackInfo->stsz.size(), 0};
+            ctts.push_back(entry);
+        }
+        else {
+            ctts.insert(ctts.end(), trackInfo->ctts.begin(), trackInfo->ctts.end());
+        }
+    }
+
+    beginBox("ctts");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(ctts.size());
+    for (vector<cttsEntry>::iterator i = ctts.begin(); i != ctts.end(); ++i) {
+        writeInt32(i->count);
+        writeInt32(i->delta);
+    }
+    endBox();
+}
+
+void
+MP4CatRewriter::writeStscBox()
+{
+    vector<stscEntry> stsc;
+    int32_t chunkBase = 0;
+    for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it) {
+        TrackInfo *trackInfo = CatTrackInfo(*it, isWritingVideoTrack());
+        for (vector<stscEntry>::iterator i = trackInfo->stsc.begin(); i != trackInfo->stsc.end(); ++i) {
+            if (stsc.empty() || stsc.back().samplesPerChunk != i->samplesPerChunk) {
+                stscEntry entry = {i->firstChunkIndex + chunkBase, i->samplesPerChunk};
+                stsc.push_back(entry);
+            }
+        }
+        chunkBase += trackInfo->stco.size();
+    }
+
+    beginBox("stsc");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(stsc.size());
+    for (vector<stscEntry>::iterator i = stsc.begin(); i != stsc.end(); ++i) {
+        writeInt32(i->firstChunkIndex);
+        writeInt32(i->samplesPerChunk);
+        writeInt32(1);      // sample description index
+    }
+    endBox();
+}
+
+void
+MP4CatRewriter::writeStssBox()
+{
+    if (isWritingVideoTrack()) {
+        beginBox("stss");
+        writeInt32(0);      // version=0, falgs=0
+
+        int32_t stssEntryCount = 0;
+        for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it) {
+            stssEntryCount += (*it)->mVideoTrackInfo->stss.size();
+        }
+        writeInt32(stssEntryCount);
+
+        int32_t off = 0;
+        for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it) {
             MP4Info *mp4info = *it;
             TrackInfo *trackInfo = mp4info->mVideoTrackInfo;
             for (vector<int32_t>::iterator i = trackInfo->stss.begin(); i != trackInfo->stss.end(); ++i) {
@@ -1092,33 +1891,23 @@ MP4CatRewriter::writeStszBox()
 void
 MP4CatRewriter::writeStcoBox()
 {
-    beginBox("stco");
-    writeInt32(0);          // version=0, flags=0
+    vector<uint64_t> offsets;
 
-    writeInt32(getSampleCount());
-
-    int32_t off = 32; // so far so good // TODO
-    for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it) {
+    int k = 0;
+    for (list<MP4Info*>::iterator it = mCatTask->mInfoList.begin(); it != mCatTask->mInfoList.end(); ++it, ++k) {
         MP4Info *mp4info = *it;
-        TrackInfo *trackInfo = NULL;
-
-        if (isWritingVideoTrack()) {
-            trackInfo = mp4info->mVideoTrackInfo;
-        }
-        else {
-            trackInfo = mp4info->mAudioTrackInfo;
-        }
+        TrackInfo *trackInfo = CatTrackInfo(mp4info, isWritingVideoTrack());
 
-        int32_t stco0 = mp4info->mVideoTrackInfo->stco[0].chunkOffset;
+        // offsets are relative to the first media byte of each source
+        uint64_t mediaData = mp4info->mdatOffset + mp4info->mdatHeaderSize;
+        uint64_t off = getMediaDataOffset() + mSourceMediaOffsets[k];
 
         for (vector<stcoEntry>::iterator i = trackInfo->stco.begin(); i != trackInfo->stco.end(); ++i) {
-            writeInt32(i->chunkOffset - stco0 + off);
+            offsets.push_back(i->chunkOffset - mediaData + off);
         }
-
-        off += mp4info->mdatSize - 8;
     }
 
-    endBox();    
+    writeChunkOffsetBox(offsets);
 }
 
 int32_t
@@ -1218,4 +2007,677 @@ MP4CatRewriter::getSampleCount()
     return isWritingVideoTrack() ? mVideoSampleCount : mAudioSampleCount;
 }
 
+MP4ReelRewriter::MP4ReelRewriter()
+    : mReelTask(NULL)
+    , mDurationUs(0)
+{}
+
+MP4ReelRewriter::~MP4ReelRewriter()
+{}
 
+int
+MP4ReelRewriter::write(ReelTask *reelTask)
+{
+    if (prepare(reelTask) != 0) {
+        return -1;
+    }
+
+    return MP4Rewriter::write(reelTask->mInfo);
+}
+
+int
+MP4ReelRewriter::plan(ReelTask *reelTask, MP4Layout *layout)
+{
+    if (prepare(reelTask) != 0) {
+        return -1;
+    }
+
+    return MP4Rewriter::plan(reelTask->mInfo, layout);
+}
+
+int
+MP4ReelRewriter::prepare(ReelTask *reelTask)
+{
+    mReelTask = reelTask;
+
+    MP4Info *info = reelTask->mInfo;
+    if (mVideoTable.build(info->mVideoTrackInfo) != 0 || mAudioTable.build(info->mAudioTrackInfo) != 0) {
+        _E("bad sample tables, no reel written \n");
+        return -1;
+    }
+
+    mVideoRuns.clear();
+    mAudioRuns.clear();
+    mDurationUs = 0;
+    for (vector<ReelClip>::const_iterator it = reelTask->mClips.begin(); it != reelTask->mClips.end(); ++it) {
+        vector<SampleRun> runs;
+        SampleRuns(mVideoTable, it->videoBegin, it->videoCease, &runs);
+        mVideoRuns.push_back(runs);
+        SampleRuns(mAudioTable, it->audioBegin, it->audioCease, &runs);
+        mAudioRuns.push_back(runs);
+
+        uint64_t duration = mVideoTable.sampleTime(it->videoCease) - mVideoTable.sampleTime(it->videoBegin);
+        mDurationUs += duration * 1000000 / info->mVideoTrackInfo->timeScale;
+    }
+
+    return 0;
+}
+
+// as for a cat, each clip on its own block offsets for reflink
+void
+MP4ReelRewriter::planMediaData(off_t offset)
+{
+    uint64_t mediaDataSize = 0;
+    bool largeSize = false;
+    for (int pass = 0; pass < 2; ++pass) {
+        off_t mediaData = offset + (largeSize ? 16 : 8);
+        mediaDataSize = 0;
+        mClipMediaOffsets.clear();
+        for (vector<ReelClip>::const_iterator it = mReelTask->mClips.begin(); it != mReelTask->mClips.end(); ++it) {
+            mediaDataSize += alignmentPadding(mediaData + mediaDataSize, it->beginOffset);
+            mClipMediaOffsets.push_back(mediaDataSize);
+            mediaDataSize += it->ceaseOffset - it->beginOffset;
+        }
+        if (largeSize || MdatHeaderSize(mediaDataSize) == 8) {
+            break;
+        }
+        largeSize = true;
+    }
+    setMediaDataLayout(offset, 0, mediaDataSize, largeSize);
+}
+
+int
+MP4ReelRewriter::writeMediaData()
+{
+    writeMediaDataHeader();
+
+    MP4Info *info = getMP4Info();
+    int srcFD = ::open(info->mFilePath.c_str(), O_RDONLY);
+    if (srcFD < 0) {
+        _E("open %s failed \n", info->mFilePath.c_str());
+        return -1;
+    }
+    int ret = 0;
+    int k = 0;
+    for (vector<ReelClip>::const_iterator it = mReelTask->mClips.begin(); it != mReelTask->mClips.end() && ret == 0; ++it, ++k) {
+        vector<uint8_t> zeros(mClipMediaOffsets[k] - (getOffset() - getMediaDataOffset()), 0);
+        MP4Rewriter::write(zeros.data(), zeros.size());
+
+        ret = copyData(srcFD, it->beginOffset, it->ceaseOffset - it->beginOffset, info->mFilePath);
+    }
+    ::close(srcFD);
+
+    int copied = runPendingCopies();
+    return ret != 0 ? ret : copied;
+}
+
+int
+MP4ReelRewriter::writeSttsBox()
+{
+    const CompactSampleTable& table = trackTable();
+    const vector<vector<SampleRun> >& clipRuns = trackRuns();
+
+    vector<sttsEntry> stts;
+    for (vector<vector<SampleRun> >::const_iterator runs = clipRuns.begin(); runs != clipRuns.end(); ++runs) {
+        for (vector<SampleRun>::const_iterator it = runs->begin(); it != runs->end(); ++it) {
+            for (uint32_t i = it->firstSample; i < it->firstSample + it->sampleCount; ++i) {
+                int32_t delta = table.sampleDelta(i);
+                if (!stts.empty() && stts.back().delta == delta) {
+                    ++stts.back().count;
+                }
+                else {
+                    sttsEntry entry = {1, delta};
+                    stts.push_back(entry);
+                }
+            }
+        }
+    }
+
+    beginBox("stts");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(stts.size());
+    for (vector<sttsEntry>::iterator i = stts.begin(); i != stts.end(); ++i) {
+        writeInt32(i->count);
+        writeInt32(i->delta);
+    }
+    endBox();
+
+    return 0;
+}
+
+void
+MP4ReelRewriter::writeCttsBox()
+{
+    const vector<cttsEntry>& source = getMP4Info()->mVideoTrackInfo->ctts;
+    if (!isWritingVideoTrack() || source.empty()) {
+        return;
+    }
+
+    vector<cttsEntry> ctts;
+    for (vector<ReelClip>::const_iterator clip = mReelTask->mClips.begin(); clip != mReelTask->mClips.end(); ++clip) {
+        AppendCttsRange(source, clip->videoBegin, clip->videoCease, ctts);
+    }
+
+    beginBox("ctts");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(ctts.size());
+    for (vector<cttsEntry>::iterator i = ctts.begin(); i != ctts.end(); ++i) {
+        writeInt32(i->count);
+        writeInt32(i->delta);
+    }
+    endBox();
+}
+
+// without stss in the source every sample is a key frame, so none here
+void
+MP4ReelRewriter::writeStssBox()
+{
+    if (!isWritingVideoTrack() || getMP4Info()->mVideoTrackInfo->stss.empty()) {
+        return;
+    }
+
+    vector<int32_t> stss;
+    int32_t id = 1;
+    for (vector<ReelClip>::const_iterator clip = mReelTask->mClips.begin(); clip != mReelTask->mClips.end(); ++clip) {
+        for (uint32_t i = clip->videoBegin; i < clip->videoCease; ++i, ++id) {
+            if (mVideoTable.isKeyFrame(i)) {
+                stss.push_back(id);
+            }
+        }
+    }
+
+    beginBox("stss");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(stss.size());
+    for (vector<int32_t>::iterator i = stss.begin(); i != stss.end(); ++i) {
+        writeInt32(*i);
+    }
+    endBox();
+}
+
+void
+MP4ReelRewriter::writeStszBox()
+{
+    const CompactSampleTable& table = trackTable();
+    const vector<vector<SampleRun> >& clipRuns = trackRuns();
+
+    beginBox("stsz");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(0);          // sample-size=0
+
+    writeInt32(getSampleCount());
+
+    for (vector<vector<SampleRun> >::const_iterator runs = clipRuns.begin(); runs != clipRuns.end(); ++runs) {
+        for (vector<SampleRun>::const_iterator it = runs->begin(); it != runs->end(); ++it) {
+            for (uint32_t i = it->firstSample; i < it->firstSample + it->sampleCount; ++i) {
+                writeInt32(table.sampleSize(i));
+            }
+        }
+    }
+
+    endBox();
+}
+
+void
+MP4ReelRewriter::writeStscBox()
+{
+    const vector<vector<SampleRun> >& clipRuns = trackRuns();
+
+    vector<stscEntry> stsc;
+    int32_t chunk = 1;
+    for (vector<vector<SampleRun> >::const_iterator runs = clipRuns.begin(); runs != clipRuns.end(); ++runs) {
+        for (vector<SampleRun>::const_iterator it = runs->begin(); it != runs->end(); ++it, ++chunk) {
+            if (stsc.empty() || stsc.back().samplesPerChunk != (int32_t)it->sampleCount) {
+                stscEntry entry = {chunk, (int32_t)it->sampleCount};
+                stsc.push_back(entry);
+            }
+        }
+    }
+
+    beginBox("stsc");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(stsc.size());
+    for (vector<stscEntry>::iterator i = stsc.begin(); i != stsc.end(); ++i) {
+        writeInt32(i->firstChunkIndex);
+        writeInt32(i->samplesPerChunk);
+        writeInt32(1);      // sample description index
+    }
+    endBox();
+}
+
+void
+MP4ReelRewriter::writeStcoBox()
+{
+    const CompactSampleTable& table = trackTable();
+    const vector<vector<SampleRun> >& clipRuns = trackRuns();
+
+    vector<uint64_t> offsets;
+    for (size_t k = 0; k < clipRuns.size(); ++k) {
+        // offsets are relative to the first byte of each clip
+        const ReelClip& clip = mReelTask->mClips[k];
+        uint64_t off = getMediaDataOffset() + mClipMediaOffsets[k];
+        for (vector<SampleRun>::const_iterator it = clipRuns[k].begin(); it != clipRuns[k].end(); ++it) {
+            offsets.push_back(table.sampleOffset(it->firstSample) - clip.beginOffset + off);
+        }
+    }
+
+    writeChunkOffsetBox(offsets);
+}
+
+int32_t
+MP4ReelRewriter::getDuration()
+{
+    return (mDurationUs * getTimeScale() + 5E5) / 1E6;
+}
+
+int64_t
+MP4ReelRewriter::getDurationUs()
+{
+    return mDurationUs;
+}
+
+int32_t
+MP4ReelRewriter::getSampleCount()
+{
+    int32_t count = 0;
+    for (vector<ReelClip>::const_iterator it = mReelTask->mClips.begin(); it != mReelTask->mClips.end(); ++it) {
+        count += isWritingVideoTrack() ? it->videoCease - it->videoBegin : it->audioCease - it->audioBegin;
+    }
+
+    return count;
+}
+
+MP4TailTrimRewriter::MP4TailTrimRewriter()
+{}
+
+MP4TailTrimRewriter::~MP4TailTrimRewriter()
+{}
+
+int
+MP4TailTrimRewriter::write(MP4Info *mp4info)
+{
+    // planning would go through writeBoxes() too, and that edits the file
+    MP4WriteOptions options = getOptions();
+    options.preallocate = false;
+    setOptions(options);
+
+    return MP4Rewriter::write(mp4info);
+}
+
+/*
+ * At every step the file is still whole: the new moov goes first, where
+ * the old one or the old media data is; the mdat is cut short next and
+ * the tail dropped last. Only a new moov behind the mdat that runs into
+ * the old one leaves a broken file if the write is cut short.
+ */
+int
+MP4TailTrimRewriter::writeBoxes(MP4Layout *layout)
+{
+    MP4Info *info = getMP4Info();
+    uint64_t mdatSize = info->trimCeaseOffset - info->mdatOffset;
+    bool moovFirst = info->moovOffset < info->mdatOffset;
+
+    // the chunk offsets stay as in the source
+    uint64_t mediaDataSize = info->trimCeaseOffset - info->trimBeginOffset;
+    setMediaDataLayout(info->trimBeginOffset - MdatHeaderSize(mediaDataSize), 0, mediaDataSize, false);
+
+    off_t moovSize = measureMoovBox();
+    off_t moovOffset = moovFirst ? info->moovOffset : info->trimCeaseOffset;
+    off_t padding = moovFirst ? info->moovSize - moovSize : 0;
+    if (padding < 0 || (padding > 0 && padding < 8)) {
+        _E("new moov of %lld bytes does not fit in the old one of %llu \n", (long long)moovSize, (unsigned long long)info->moovSize);
+        return -1;
+    }
+    if (info->mdatHeaderSize == 8 && mdatSize > UINT32_MAX) {
+        _E("mdat of %llu bytes needs a 64-bit size \n", (unsigned long long)mdatSize);
+        return -1;
+    }
+
+    layout->moovOffset = moovOffset;
+    layout->moovSize = moovSize;
+    layout->freeOffset = moovOffset + moovSize;
+    layout->freeSize = padding;
+    layout->mdatOffset = info->mdatOffset;
+    layout->mdatSize = mdatSize;
+    layout->mediaDataOffset = info->mdatOffset + info->mdatHeaderSize;
+    layout->totalSize = moovFirst ? info->trimCeaseOffset : moovOffset + moovSize;
+
+    if (seekOutput(moovOffset) != 0) {
+        return -1;
+    }
+    writeMoovBox();
+    writeFreeBox(padding);
+
+    if (seekOutput(info->mdatOffset) != 0) {
+        return -1;
+    }
+    if (info->mdatHeaderSize == 8) {
+        writeInt32(mdatSize);
+    }
+    else {
+        writeInt32(1);
+        writeFourcc("mdat");
+        writeInt64(mdatSize);
+    }
+
+    if (truncateOutput(layout->totalSize) != 0) {
+        _E("truncate to %lld bytes failed \n", (long long)layout->totalSize);
+        return -1;
+    }
+    _I("trimmed in place to %lld bytes, moov at %lld \n", (long long)layout->totalSize, (long long)moovOffset);
+    return seekOutput(layout->totalSize);
+}
+
+/*
+ * fMP4 sample flags: a sync sample depends on nothing, any other sample on
+ * an earlier one and is marked non-sync.
+ */
+#define FRAGMENT_SYNC_SAMPLE_FLAGS      0x02000000
+#define FRAGMENT_NON_SYNC_SAMPLE_FLAGS  0x01010000
+
+#define TFHD_DEFAULT_BASE_IS_MOOF       0x020000
+
+#define TRUN_DATA_OFFSET                0x000001
+#define TRUN_SAMPLE_DURATION            0x000100
+#define TRUN_SAMPLE_SIZE                0x000200
+#define TRUN_SAMPLE_FLAGS               0x000400
+#define TRUN_SAMPLE_COMPOSITION_OFFSET  0x000800
+
+MP4FragmentRewriter::MP4FragmentRewriter()
+{}
+
+MP4FragmentRewriter::~MP4FragmentRewriter()
+{}
+
+/*
+ * The init segment, then fragment after fragment, each moof right in
+ * front of its own media data so a fragment can be played as soon as it
+ * is out. The mdat fields of the layout span all the fragments.
+ */
+int
+MP4FragmentRewriter::writeBoxes(MP4Layout *layout)
+{
+    MP4Info *info = getMP4Info();
+
+    layout->ftypOffset = getOffset();
+    writeFtypBox();
+    layout->ftypSize = getOffset() - layout->ftypOffset;
+
+    layout->moovOffset = getOffset();
+    writeMoovBox();
+    layout->moovSize = getOffset() - layout->moovOffset;
+
+    layout->freeOffset = getOffset();
+    layout->mdatOffset = getOffset();
+
+    if (mVideoTable.build(info->mVideoTrackInfo) != 0 || mAudioTable.build(info->mAudioTrackInfo) != 0) {
+        _E("bad sample tables, no fragments written \n");
+        layout->totalSize = getOffset();
+        return -1;
+    }
+
+    uint32_t video = info->trimBeginVideoID - 1;
+    uint32_t videoCease = info->trimCeaseVideoID - 1;
+    uint32_t audio = info->trimBeginAudioID - 1;
+    uint32_t audioCease = info->trimCeaseAudioID - 1;
+
+    mCompositionOffsets.clear();
+    const vector<cttsEntry>& ctts = info->mVideoTrackInfo->ctts;
+    uint32_t first = 0;
+    for (vector<cttsEntry>::const_iterator it = ctts.begin(); it != ctts.end() && first < videoCease; ++it) {
+        for (int32_t i = 0; i < it->count && first < videoCease; ++i, ++first) {
+            if (first >= video) {
+                mCompositionOffsets.push_back(it->delta);
+            }
+        }
+    }
+    if (!mCompositionOffsets.empty()) {
+        mCompositionOffsets.resize(videoCease - video, mCompositionOffsets.back());
+    }
+
+    int srcFD = ::open(info->mFilePath.c_str(), O_RDONLY);
+    if (srcFD < 0) {
+        _E("open %s failed \n", info->mFilePath.c_str());
+        return -1;
+    }
+    int ret = 0;
+    uint32_t sequence = 1;
+    while (video < videoCease && ret == 0) {
+        uint32_t cut = nextFragment(video, videoCease);
+        off_t begin = mVideoTable.sampleOffset(video);
+        off_t cease = cut < videoCease ? (off_t)mVideoTable.sampleOffset(cut) : info->trimCeaseOffset;
+
+        // audio chunks never straddle a video sample, so they fall wholly
+        // on one side of the cut
+        uint32_t audioCut = audio;
+        while (audioCut < audioCease && (off_t)mAudioTable.sampleOffset(audioCut) < cease) {
+            ++audioCut;
+        }
+
+        ret = writeFragment(srcFD, sequence++, begin, cease, video, cut, audio, audioCut);
+        if (layout->mediaDataOffset == 0) {
+            layout->mediaDataOffset = getMediaDataOffset();
+        }
+
+        video = cut;
+        audio = audioCut;
+    }
+    ::close(srcFD);
+
+    int copied = runPendingCopies();
+
+    layout->mdatSize = getOffset() - layout->mdatOffset;
+    layout->totalSize = getOffset();
+    _I("%u fragments, %lld bytes \n", sequence - 1, (long long)layout->mdatSize);
+    return ret != 0 ? ret : copied;
+}
+
+/*
+ * The first key frame at least fragmentDurationMs after videoSample, or
+ * videoCease when the trim ends first.
+ */
+uint32_t
+MP4FragmentRewriter::nextFragment(uint32_t videoSample, uint32_t videoCease) const
+{
+    const TrackInfo *ti = getMP4Info()->mVideoTrackInfo;
+    uint64_t span = (uint64_t)getOptions().fragmentDurationMs * ti->timeScale / 1000;
+    uint32_t cut = mVideoTable.timeIndex().firstSampleAtOrAfter(mVideoTable.sampleTime(videoSample) + span);
+    cut = max(cut, videoSample + 1);
+
+    // stss is 1-based; no stss makes every sample a key frame
+    if (!ti->stss.empty()) {
+        vector<int32_t>::const_iterator key = lower_bound(ti->stss.begin(), ti->stss.end(), (int32_t)cut + 1);
+        cut = key == ti->stss.end() ? videoCease : *key - 1;
+    }
+
+    return min(cut, videoCease);
+}
+
+// traf + tfhd + tfdt (version 1), and a trun with a data offset per run
+off_t
+MP4FragmentRewriter::TrafSize(const vector<SampleRun>& runs, int sampleBytes)
+{
+    if (runs.empty()) {
+        return 0;
+    }
+    off_t size = 8 + 16 + 20;
+    for (vector<SampleRun>::const_iterator it = runs.begin(); it != runs.end(); ++it) {
+        size += 20 + (off_t)it->sampleCount * sampleBytes;
+    }
+    return size;
+}
+
+/*
+ * The trun data offsets count from the moof (default-base-is-moof), so
+ * the moof size is worked out before the moof is written.
+ */
+int
+MP4FragmentRewriter::writeFragment(int srcFD, uint32_t sequence, off_t begin, off_t cease,
+        uint32_t videoBegin, uint32_t videoCease, uint32_t audioBegin, uint32_t audioCease)
+{
+    MP4Info *info = getMP4Info();
+
+    vector<SampleRun> videoRuns;
+    vector<SampleRun> audioRuns;
+    SampleRuns(mVideoTable, videoBegin, videoCease, &videoRuns);
+    SampleRuns(mAudioTable, audioBegin, audioCease, &audioRuns);
+
+    uint64_t mediaDataSize = cease - begin;
+    off_t moofSize = 8 + 16
+        + TrafSize(videoRuns, mCompositionOffsets.empty() ? 12 : 16)
+        + TrafSize(audioRuns, 8);
+    off_t dataOffset = moofSize + MdatHeaderSize(mediaDataSize);
+
+    off_t moofOffset = getOffset();
+    beginBox("moof");
+    {
+        beginBox("mfhd");
+        writeInt32(0);          // version=0, flags=0
+        writeInt32(sequence);
+        endBox();
+
+        beginVideoTrack();
+        writeTrafBox(mVideoTable, videoRuns, info->trimBeginVideoID - 1, dataOffset, begin);
+#ifndef NO_AUDIO
+        beginAudioTrack();
+        writeTrafBox(mAudioTable, audioRuns, info->trimBeginAudioID - 1, dataOffset, begin);
+#endif
+    }
+    endBox();
+    if (getOffset() - moofOffset != moofSize) {
+        _E("moof %u is %lld bytes, planned %lld \n", sequence, (long long)(getOffset() - moofOffset), (long long)moofSize);
+    }
+
+    writeMdatHeader(mediaDataSize);
+    return copyData(srcFD, begin, mediaDataSize, info->mFilePath);
+}
+
+void
+MP4FragmentRewriter::writeTrafBox(const CompactSampleTable& table, const vector<SampleRun>& runs,
+        uint32_t trackFirstSample, off_t dataOffset, off_t begin)
+{
+    if (runs.empty()) {
+        return;
+    }
+
+    bool video = isWritingVideoTrack();
+    bool composition = video && !mCompositionOffsets.empty();
+
+    beginBox("traf");
+    {
+        beginBox("tfhd");
+        writeInt32(TFHD_DEFAULT_BASE_IS_MOOF);  // version=0
+        writeInt32(getTrackID());
+        endBox();
+
+        // decode time of the first sample, from the start of the trim
+        beginBox("tfdt");
+        writeInt32(0x01000000);  // version=1, flags=0
+        writeInt64(table.sampleTime(runs.front().firstSample) - table.sampleTime(trackFirstSample));
+        endBox();
+
+        int32_t flags = TRUN_DATA_OFFSET | TRUN_SAMPLE_DURATION | TRUN_SAMPLE_SIZE;
+        if (video) {
+            flags |= TRUN_SAMPLE_FLAGS;
+        }
+        if (composition) {
+            flags |= TRUN_SAMPLE_COMPOSITION_OFFSET;
+        }
+
+        for (vector<SampleRun>::const_iterator it = runs.begin(); it != runs.end(); ++it) {
+            beginBox("trun");
+            writeInt32(flags);  // version=0
+            writeInt32(it->sampleCount);
+            writeInt32(dataOffset + table.sampleOffset(it->firstSample) - begin);
+            for (uint32_t i = it->firstSample; i < it->firstSample + it->sampleCount; ++i) {
+                writeInt32(table.sampleDelta(i));
+                writeInt32(table.sampleSize(i));
+                if (video) {
+                    writeInt32(table.isKeyFrame(i) ? FRAGMENT_SYNC_SAMPLE_FLAGS : FRAGMENT_NON_SYNC_SAMPLE_FLAGS);
+                }
+                if (composition) {
+                    writeInt32(mCompositionOffsets[i - trackFirstSample]);
+                }
+            }
+            endBox();
+        }
+    }
+    endBox();
+}
+
+/*
+ * mehd with the trimmed duration, and a trex per track whose defaults the
+ * truns override anyway.
+ */
+void
+MP4FragmentRewriter::writeMvexBox()
+{
+    beginBox("mvex");
+    {
+        beginBox("mehd");
+        writeInt32(0x01000000);  // version=1, flags=0
+        writeInt64(getDuration());
+        endBox();
+
+#ifndef NO_AUDIO
+        int32_t trackCount = 2;
+#else
+        int32_t trackCount = 1;
+#endif
+        for (int32_t trackID = 1; trackID <= trackCount; ++trackID) {
+            beginBox("trex");
+            writeInt32(0);      // version=0, flags=0
+            writeInt32(trackID);
+            writeInt32(1);      // sample description index
+            writeInt32(0);      // default sample duration
+            writeInt32(0);      // default sample size
+            writeInt32(0);      // default sample flags
+            endBox();
+        }
+    }
+    endBox();
+}
+
+// the init segment has no samples of its own, the fragments carry them all
+int
+MP4FragmentRewriter::writeSttsBox()
+{
+    beginBox("stts");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(0);          // entry count
+    endBox();
+    return 0;
+}
+
+void
+MP4FragmentRewriter::writeCttsBox()
+{}
+
+void
+MP4FragmentRewriter::writeStssBox()
+{}
+
+void
+MP4FragmentRewriter::writeStszBox()
+{
+    beginBox("stsz");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(0);          // sample size
+    writeInt32(0);          // sample count
+    endBox();
+}
+
+void
+MP4FragmentRewriter::writeStscBox()
+{
+    beginBox("stsc");
+    writeInt32(0);          // version=0, flags=0
+    writeInt32(0);          // entry count
+    endBox();
+}
+
+void
+MP4FragmentRewriter::writeStcoBox()
+{
+    writeChunkOffsetBox(vector<uint64_t>());
+}
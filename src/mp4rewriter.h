@@ -5,8 +5,11 @@
 
 #include <string>
 #include <list>
+#include <vector>
 
 #include "mp4trimmer.h"
+#include "mp4copyengine.h"
+#include "mp4sampletable.h"
 
 struct MP4Info;
 struct TrackInfo;
@@ -19,14 +22,37 @@ public:
 
 	int setOutputPath(const std::string path);
 
+	// write to fd instead, which stays open; pipes, sockets and the like
+	// get the strictly sequential output: moov first, no seek, no pwrite.
+	// A file fd has to be at offset 0 and not O_APPEND.
+	int setOutputFD(int fd);
+
+	int setOptions(const MP4WriteOptions& options);
+
 	int open();
 	int close();
+	int flush();
 
 	int write(MP4Info *mp4info);
 
+	// the layout write() would produce, without writing or copying a byte
+	int plan(MP4Info *mp4info, MP4Layout *layout);
+
+	// how the media data of the last copyData() went
+	CopyPath getCopyPath() const { return mCopyPath; }
+
+	// the 9 composition matrix elements for a clockwise rotation of 0, 90,
+	// 180 or 270 degrees, in file order; false for any other angle
+	static bool CompositionMatrix(int degrees, uint32_t matrix[9]);
+
 protected:
 
-	int copyData(int srcFD, off_t posi, int size, const std::string srcName);
+	int writeLayout();
+	int planLayout(MP4Layout *layout);
+	virtual int writeBoxes(MP4Layout *layout);
+
+	int copyData(int srcFD, off_t posi, off_t size, const std::string srcName);
+	int runPendingCopies();
 
 	size_t write(const void* data, size_t size, size_t nmemb);
 
@@ -40,22 +66,52 @@ protected:
 
 	struct BoxInfo
 	{
-		off_t offset;
+		off_t offset; // of the size field in mBuffer
 		const char* name;
 	};
-	std::list<BoxInfo> mBoxes;
+	std::vector<BoxInfo> mBoxes;
 
 
 	void beginBox(const char* fourcc);
 	void endBox();
 
+	off_t alignmentPadding(off_t outputOffset, off_t sourceOffset) const;
+
+	// lay out the media data as if it started at offset, then write it
+	virtual void planMediaData(off_t offset);
+	virtual int writeMediaData();
+	bool planMediaSpans();
+	off_t outputOffsetOf(off_t sourceOffset) const;
+	void setMediaDataLayout(off_t offset, off_t padding, uint64_t mediaDataSize, bool largeSize);
+	void writeMediaDataHeader();
+	void writeLeadingMoovBox();
+	off_t measureMoovBox();
+
+	// for output that is rewritten in place
+	int seekOutput(off_t offset);
+	int truncateOutput(off_t size);
+
 	void writeFtypBox();
+	void writeFreeBox(off_t padding);
+	static int MdatHeaderSize(uint64_t mediaDataSize);
+	void writeMdatHeader(uint64_t mediaDataSize, bool largeSize = false);
+	void writeChunkOffsetBox(const std::vector<uint64_t>& offsets);
+
+	// samples that sit back to back in the source
+	struct SampleRun
+	{
+		uint32_t firstSample;
+		uint32_t sampleCount;
+	};
+	static void SampleRuns(const CompactSampleTable& table, uint32_t begin, uint32_t cease, std::vector<SampleRun> *runs);
 	void writeMoovBox();
+	virtual void writeMvexBox() {}
 	void writeMvhdBox();
 	void writeCompositionMatrix(int degress);
 
 	void writeTrackInfo();
 	void writeTkhdBox(uint32_t now);
+	void writeEdtsBox();
 	void writeMdhdBox(uint32_t now);
 	void writeHdlrBox();
 	void writeVmhdBox();
@@ -66,8 +122,11 @@ protected:
 	void writeVideoFourCCBox();
 	void writeAudioFourCCBox();
 
+	virtual int writeSttsBox();
+	virtual void writeCttsBox();
 	virtual void writeStssBox();
 	virtual void writeStszBox();
+	virtual void writeStscBox();
 	virtual void writeStcoBox();
 
 protected:
@@ -78,8 +137,21 @@ protected:
 
 	int32_t getTrackID() { return mIsWritingVideoTrack ? 1 : 2; }
 
+	const MP4WriteOptions& getOptions() const { return mOptions; }
+	MP4Info* getMP4Info() const { return mMP4Info; }
+	bool hasLeadingMoov() const { return mOptions.faststart || mSequentialOutput; }
+	off_t getOffset() const { return mOffset; }
+	off_t getMediaDataOffset() const { return mMediaDataOffset; }
+
 	virtual int32_t getDuration() { return mMP4Info->postTrimDuration; }
 	virtual int64_t getDurationUs() { return mMP4Info->postTrimDurationUs; }
+
+	// where the video or audio is presented from, in its timescale;
+	// negative for a track that starts late, always 0 without editList
+	virtual int64_t getLeadIn(bool video);
+	bool hasEditList() { return getLeadIn(true) != 0 || getLeadIn(false) != 0; }
+	// getDuration() less the video lead-in
+	int32_t getPresentedDuration();
 	virtual int32_t getTimeScale() { return mMP4Info->timeScale; }
 	virtual int32_t getTrackCount() { return mMP4Info->trackCount; }
 	virtual int32_t getVideoWidth() { return mMP4Info->mVideoTrackInfo->_width; }
@@ -129,9 +201,62 @@ private:
 	std::string mPath;
 
 	int mFD;
+	bool mOwnFD;
+
+	// the output only takes bytes in order
+	bool mSequentialOutput;
 
 	off_t mOffset;
 
+	// output not yet handed to write(2); mOffset counts it already
+	enum { OUTPUT_BUFFER_SIZE = 1 << 20 };
+	std::vector<uint8_t> mBuffer;
+
+	// set by the first flush() that fails; from then on nothing more is
+	// buffered or written, and close() reports it
+	int mError;
+
+	// where the first media byte lands in the output
+	off_t mMediaDataOffset;
+
+	CopyPath mCopyPath;
+
+	MP4WriteOptions mOptions;
+
+	// of the output filesystem when reflink is on, 0 otherwise
+	off_t mBlockSize;
+
+	// from planMediaData()
+	off_t mMediaDataPadding;
+	uint64_t mMediaDataSize;
+	bool mLargeMediaDataHeader;
+
+	// keep everything in mBuffer, a leading moov may be laid out again
+	bool mHoldOutput;
+
+	// only count the bytes, for plan()
+	bool mDryRun;
+
+	// a source range of the trimmed media data, and where it goes from
+	// the first media byte on
+	struct MediaSpan
+	{
+		off_t srcOffset;
+		off_t size;
+		off_t mediaOffset;
+	};
+	static bool compareMediaSpanSource(const MediaSpan& a, const MediaSpan& b) { return a.srcOffset < b.srcOffset; }
+	static void TrackMediaSpans(const TrackInfo *ti, stcoVectorIterator chunk, uint32_t begin, uint32_t cease, std::vector<MediaSpan> *spans);
+
+	// by source offset; empty when the media data is one range
+	std::vector<MediaSpan> mMediaSpans;
+
+	// media data queued for a parallel copy; the ranges of one source share
+	// a duplicate of the caller's fd, mPendingSrc and its name
+	std::vector<CopyRange> mPendingCopies;
+	int mPendingSrc;
+	std::string mPendingSrcName;
+
 	bool mIsWritingVideoTrack;
 	bool mIsWritingAudioTrack;
 
@@ -149,14 +274,22 @@ public:
     ~MP4CatRewriter();
 
     int write(CatTask *);
+    int plan(CatTask *, MP4Layout *layout);
 
 protected:
+    virtual void planMediaData(off_t offset) override;
+    virtual int writeMediaData() override;
+
+    virtual int writeSttsBox() override;
+    virtual void writeCttsBox() override;
     virtual void writeStssBox() override;
     virtual void writeStszBox() override;
+    virtual void writeStscBox() override;
     virtual void writeStcoBox() override;
 
     virtual int32_t getDuration() override;
     virtual int64_t getDurationUs() override;
+    virtual int64_t getLeadIn(bool) override { return 0; }
     virtual int32_t getTimeScale() override;
     virtual int32_t getTrackCount() override;
     virtual int32_t getVideoWidth() override;
@@ -172,10 +305,124 @@ protected:
 private:
     CatTask     *mCatTask;
 
+    // where each source starts, relative to the first media byte
+    std::vector<uint64_t> mSourceMediaOffsets;
+
     int32_t     mDuration;
     int32_t     mVideoSampleCount;
     int32_t     mAudioSampleCount;
 };
 
-#endif // MP4_REWRITER_H
+/*
+ * Clips of one source one after the other, as if each were trimmed and
+ * the trims concatenated. The media data of every clip is its source
+ * range copied as is, and every run of back to back samples in it
+ * becomes a chunk.
+ */
+class MP4ReelRewriter : public MP4Rewriter
+{
+public:
+    MP4ReelRewriter();
+    ~MP4ReelRewriter();
+
+    int write(ReelTask *);
+    int plan(ReelTask *, MP4Layout *layout);
 
+protected:
+    virtual void planMediaData(off_t offset) override;
+    virtual int writeMediaData() override;
+
+    virtual int writeSttsBox() override;
+    virtual void writeCttsBox() override;
+    virtual void writeStssBox() override;
+    virtual void writeStszBox() override;
+    virtual void writeStscBox() override;
+    virtual void writeStcoBox() override;
+
+    virtual int32_t getDuration() override;
+    virtual int64_t getDurationUs() override;
+    virtual int64_t getLeadIn(bool) override { return 0; }
+    virtual int32_t getSampleCount() override;
+
+private:
+    int prepare(ReelTask *);
+
+    const CompactSampleTable& trackTable() const { return isWritingVideoTrack() ? mVideoTable : mAudioTable; }
+    const std::vector<std::vector<SampleRun> >& trackRuns() const { return isWritingVideoTrack() ? mVideoRuns : mAudioRuns; }
+
+    ReelTask *mReelTask;
+
+    CompactSampleTable mVideoTable;
+    CompactSampleTable mAudioTable;
+
+    // per clip
+    std::vector<std::vector<SampleRun> > mVideoRuns;
+    std::vector<std::vector<SampleRun> > mAudioRuns;
+
+    // where each clip starts, relative to the first media byte
+    std::vector<uint64_t> mClipMediaOffsets;
+
+    int64_t mDurationUs;
+};
+
+/*
+ * A trim from the very start, written over its own source: the samples
+ * kept are already where they belong, so the mdat is only cut short at
+ * the trim cease and the moov rewritten, behind the mdat or in place of
+ * the old one, before the file is truncated. No media byte is touched.
+ */
+class MP4TailTrimRewriter : public MP4Rewriter
+{
+public:
+    MP4TailTrimRewriter();
+    ~MP4TailTrimRewriter();
+
+    // mp4info is of the file open read-write as the output fd
+    int write(MP4Info *mp4info);
+
+protected:
+    virtual int writeBoxes(MP4Layout *layout) override;
+};
+
+/*
+ * A trim as fragmented MP4: an init segment (ftyp, and a moov with mvex and
+ * empty sample tables) followed by a moof and mdat per fragment. Each
+ * fragment starts at a video key frame and runs for at least
+ * fragmentDurationMs of the options; its mdat is the source range between
+ * two such key frames, copied as is.
+ */
+class MP4FragmentRewriter : public MP4Rewriter
+{
+public:
+    MP4FragmentRewriter();
+    ~MP4FragmentRewriter();
+
+protected:
+    virtual int writeBoxes(MP4Layout *layout) override;
+    virtual void writeMvexBox() override;
+
+    virtual int writeSttsBox() override;
+    virtual void writeCttsBox() override;
+    virtual void writeStssBox() override;
+    virtual void writeStszBox() override;
+    virtual void writeStscBox() override;
+    virtual void writeStcoBox() override;
+
+private:
+    // each SampleRun gets a trun
+    uint32_t nextFragment(uint32_t videoSample, uint32_t videoCease) const;
+    static off_t TrafSize(const std::vector<SampleRun>& runs, int sampleBytes);
+
+    int writeFragment(int srcFD, uint32_t sequence, off_t begin, off_t cease,
+            uint32_t videoBegin, uint32_t videoCease, uint32_t audioBegin, uint32_t audioCease);
+    void writeTrafBox(const CompactSampleTable& table, const std::vector<SampleRun>& runs,
+            uint32_t trackFirstSample, off_t dataOffset, off_t begin);
+
+    CompactSampleTable mVideoTable;
+    CompactSampleTable mAudioTable;
+
+    // ctts expanded over the trimmed video samples, empty without ctts
+    std::vector<int32_t> mCompositionOffsets;
+};
+
+#endif // MP4_REWRITER_H
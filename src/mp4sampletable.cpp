@@ -0,0 +1,397 @@
+#include "mp4sampletable.h"
+
+#include <algorithm>
+
+using namespace std;
+
+uint8_t
+PackedArray::widthFor(uint64_t maxValue)
+{
+    uint8_t width = 1;
+    while (width < 8 && (maxValue >> (width * 8)) != 0) {
+        ++width;
+    }
+    return width;
+}
+
+void
+PackedArray::reset(uint64_t maxValue, size_t count)
+{
+    mWidth = widthFor(maxValue);
+    mCount = count;
+    mBytes.assign(count * mWidth, 0);
+    mBytes.shrink_to_fit();
+}
+
+void
+PackedArray::set(size_t index, uint64_t value)
+{
+    uint8_t *p = &mBytes[index * mWidth];
+    for (int i = 0; i < mWidth; ++i, value >>= 8) {
+        p[i] = value & 0xff;
+    }
+}
+
+uint64_t
+PackedArray::get(size_t index) const
+{
+    const uint8_t *p = &mBytes[index * mWidth];
+    uint64_t value = 0;
+    for (int i = mWidth - 1; i >= 0; --i) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+void
+SampleTimeIndex::build(const vector<sttsEntry>& stts)
+{
+    mRuns.clear();
+    mRuns.reserve(stts.size() + 1);
+
+    Run run = {0, 0, 0};
+    for (vector<sttsEntry>::const_iterator it = stts.begin(); it != stts.end(); ++it) {
+        if (it->count <= 0) {
+            continue;
+        }
+        run.delta = it->delta;
+        mRuns.push_back(run);
+        run.firstSample += it->count;
+        run.firstTime += (uint64_t)it->count * (uint32_t)it->delta;
+    }
+
+    run.delta = 0;
+    mRuns.push_back(run);
+    mRuns.shrink_to_fit();
+}
+
+size_t
+SampleTimeIndex::runOfSample(uint32_t sample) const
+{
+    size_t lo = 0, hi = mRuns.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (mRuns[mid].firstSample <= sample) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+uint64_t
+SampleTimeIndex::sampleTime(uint32_t sample) const
+{
+    if (mRuns.empty()) {
+        return 0;
+    }
+    const Run& run = mRuns[runOfSample(sample)];
+    if (sample >= sampleCount()) {
+        return duration();
+    }
+    return run.firstTime + (uint64_t)(sample - run.firstSample) * run.delta;
+}
+
+uint32_t
+SampleTimeIndex::sampleDelta(uint32_t sample) const
+{
+    return mRuns.empty() ? 0 : mRuns[runOfSample(sample)].delta;
+}
+
+uint32_t
+SampleTimeIndex::firstSampleAtOrAfter(uint64_t t) const
+{
+    if (mRuns.size() < 2) {
+        return 0;
+    }
+
+    // first run whose last sample is at or after t
+    size_t lo = 0, hi = mRuns.size() - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const Run& run = mRuns[mid];
+        uint64_t lastTime = run.firstTime + (uint64_t)(mRuns[mid + 1].firstSample - run.firstSample - 1) * run.delta;
+        if (lastTime < t) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo == mRuns.size() - 1) {
+        return sampleCount();
+    }
+
+    const Run& run = mRuns[lo];
+    if (run.firstTime >= t) {
+        return run.firstSample;
+    }
+    return run.firstSample + (t - run.firstTime + run.delta - 1) / run.delta;
+}
+
+uint32_t
+SampleTimeIndex::lastSampleAtOrBefore(uint64_t t) const
+{
+    if (mRuns.size() < 2) {
+        return 0;
+    }
+
+    // last real run that starts at or before t
+    size_t lo = 0, hi = mRuns.size() - 1;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (mRuns[mid].firstTime <= t) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    const Run& run = mRuns[lo];
+    uint32_t last = mRuns[lo + 1].firstSample - run.firstSample - 1;
+    if (run.delta == 0 || t < run.firstTime) {
+        return t < run.firstTime ? run.firstSample : run.firstSample + last;
+    }
+    return run.firstSample + min<uint64_t>((t - run.firstTime) / run.delta, last);
+}
+
+void
+SampleSizeTable::build(const vector<int32_t>& stsz)
+{
+    mCount = stsz.size();
+    mConstantSize = 0;
+    mRuns.clear();
+    mSizes = PackedArray();
+
+    uint32_t maxSize = 0;
+    size_t runCount = 0;
+    for (size_t i = 0; i < stsz.size(); ++i) {
+        maxSize = max<uint32_t>(maxSize, stsz[i]);
+        if (i == 0 || stsz[i] != stsz[i - 1]) {
+            ++runCount;
+        }
+    }
+
+    if (runCount <= 1) {
+        mConstantSize = stsz.empty() ? 0 : stsz[0];
+        return;
+    }
+
+    size_t packedBytes = (size_t)PackedArray::widthFor(maxSize) * mCount;
+
+    if (runCount * sizeof(Run) < packedBytes) {
+        mRuns.reserve(runCount);
+        for (size_t i = 0; i < stsz.size(); ++i) {
+            if (i == 0 || stsz[i] != stsz[i - 1]) {
+                Run run = {(uint32_t)i, (uint32_t)stsz[i]};
+                mRuns.push_back(run);
+            }
+        }
+    }
+    else {
+        mSizes.reset(maxSize, mCount);
+        for (size_t i = 0; i < stsz.size(); ++i) {
+            mSizes.set(i, (uint32_t)stsz[i]);
+        }
+    }
+}
+
+uint32_t
+SampleSizeTable::sampleSize(uint32_t sample) const
+{
+    if (!mRuns.empty()) {
+        size_t lo = 0, hi = mRuns.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (mRuns[mid].firstSample <= sample) {
+                lo = mid;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        return mRuns[lo].size;
+    }
+    if (mSizes.size()) {
+        return mSizes.get(sample);
+    }
+    return mConstantSize;
+}
+
+uint64_t
+SampleSizeTable::rangeSize(uint32_t begin, uint32_t end) const
+{
+    if (mRuns.empty() && mSizes.size() == 0) {
+        return (uint64_t)(end - begin) * mConstantSize;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t i = begin; i < end; ++i) {
+        total += sampleSize(i);
+    }
+    return total;
+}
+
+size_t
+SampleSizeTable::memoryFootprint() const
+{
+    return mRuns.capacity() * sizeof(Run) + mSizes.memoryFootprint();
+}
+
+void
+ChunkOffsetTable::build(const vector<stcoEntry>& stco)
+{
+    mCheckpoints.clear();
+
+    mDelta = true;
+    uint64_t maxValue = 0;
+    for (size_t i = 0; i < stco.size(); ++i) {
+        uint64_t offset = (uint64_t)stco[i].chunkOffset;
+        if (i % CHECKPOINT_INTERVAL == 0) {
+            continue;
+        }
+        uint64_t previous = (uint64_t)stco[i - 1].chunkOffset;
+        if (offset < previous) {
+            mDelta = false;
+            break;
+        }
+        maxValue = max(maxValue, offset - previous);
+    }
+
+    if (mDelta) {
+        mValues.reset(maxValue, stco.size());
+        mCheckpoints.reserve((stco.size() + CHECKPOINT_INTERVAL - 1) / CHECKPOINT_INTERVAL);
+        for (size_t i = 0; i < stco.size(); ++i) {
+            uint64_t offset = (uint64_t)stco[i].chunkOffset;
+            if (i % CHECKPOINT_INTERVAL == 0) {
+                mCheckpoints.push_back(offset);
+            }
+            else {
+                mValues.set(i, offset - (uint64_t)stco[i - 1].chunkOffset);
+            }
+        }
+    }
+    else {
+        maxValue = 0;
+        for (size_t i = 0; i < stco.size(); ++i) {
+            maxValue = max<uint64_t>(maxValue, (uint64_t)stco[i].chunkOffset);
+        }
+        mValues.reset(maxValue, stco.size());
+        for (size_t i = 0; i < stco.size(); ++i) {
+            mValues.set(i, (uint64_t)stco[i].chunkOffset);
+        }
+    }
+}
+
+uint64_t
+ChunkOffsetTable::chunkOffset(uint32_t chunk) const
+{
+    if (!mDelta) {
+        return mValues.get(chunk);
+    }
+
+    uint32_t checkpoint = chunk / CHECKPOINT_INTERVAL;
+    uint64_t offset = mCheckpoints[checkpoint];
+    for (uint32_t i = checkpoint * CHECKPOINT_INTERVAL + 1; i <= chunk; ++i) {
+        offset += mValues.get(i);
+    }
+    return offset;
+}
+
+int
+CompactSampleTable::build(const TrackInfo *ti)
+{
+    if (ti == NULL || ti->mTablesDeferred) {
+        return -1;
+    }
+
+    mTimes.build(ti->stts);
+    mSizes.build(ti->stsz);
+    mChunkOffsets.build(ti->stco);
+
+    mChunkRuns.clear();
+    uint32_t chunkCount = mChunkOffsets.chunkCount();
+    uint32_t firstSample = 0;
+    for (size_t i = 0; i < ti->stsc.size(); ++i) {
+        uint32_t firstChunk = ti->stsc[i].firstChunkIndex - 1;
+        uint32_t nextChunk = (i + 1 < ti->stsc.size()) ? ti->stsc[i + 1].firstChunkIndex - 1 : chunkCount;
+        nextChunk = min(nextChunk, chunkCount);
+        if (nextChunk <= firstChunk || ti->stsc[i].samplesPerChunk <= 0) {
+            continue;
+        }
+        ChunkRun run = {firstChunk, firstSample, (uint32_t)ti->stsc[i].samplesPerChunk};
+        mChunkRuns.push_back(run);
+        firstSample += (nextChunk - firstChunk) * run.samplesPerChunk;
+    }
+    mChunkRuns.shrink_to_fit();
+
+    mKeyFrames.assign(ti->stss.begin(), ti->stss.end());
+    mKeyFrames.shrink_to_fit();
+
+    if (mChunkRuns.empty() || firstSample < sampleCount()) {
+        return -2;
+    }
+    return 0;
+}
+
+uint32_t
+CompactSampleTable::chunkOfSample(uint32_t sample, uint32_t *firstSampleInChunk) const
+{
+    size_t lo = 0, hi = mChunkRuns.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (mChunkRuns[mid].firstSample <= sample) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    const ChunkRun& run = mChunkRuns[lo];
+    uint32_t n = (sample - run.firstSample) / run.samplesPerChunk;
+    if (firstSampleInChunk != NULL) {
+        *firstSampleInChunk = run.firstSample + n * run.samplesPerChunk;
+    }
+    return run.firstChunk + n;
+}
+
+uint64_t
+CompactSampleTable::sampleOffset(uint32_t sample) const
+{
+    uint32_t first = 0;
+    uint32_t chunk = chunkOfSample(sample, &first);
+    return chunkOffset(chunk) + mSizes.rangeSize(first, sample);
+}
+
+bool
+CompactSampleTable::isKeyFrame(uint32_t sample) const
+{
+    return mKeyFrames.empty() || binary_search(mKeyFrames.begin(), mKeyFrames.end(), sample + 1);
+}
+
+uint32_t
+CompactSampleTable::keyFrameAtOrBefore(uint32_t sample) const
+{
+    if (mKeyFrames.empty()) {
+        return sample;
+    }
+    vector<uint32_t>::const_iterator it = upper_bound(mKeyFrames.begin(), mKeyFrames.end(), sample + 1);
+    if (it == mKeyFrames.begin()) {
+        return 0;
+    }
+    return *--it - 1;
+}
+
+size_t
+CompactSampleTable::memoryFootprint() const
+{
+    return mTimes.memoryFootprint()
+        + mSizes.memoryFootprint()
+        + mChunkOffsets.memoryFootprint()
+        + mChunkRuns.capacity() * sizeof(ChunkRun)
+        + mKeyFrames.capacity() * sizeof(uint32_t);
+}
@@ -0,0 +1,168 @@
+#ifndef MP4_SAMPLE_TABLE_H
+#define MP4_SAMPLE_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+#include "mp4trimmer.h"
+
+/*
+ * Unsigned integers stored with a fixed width of 1 to 8 bytes each, the
+ * width being the smallest one that holds the largest value.
+ */
+class PackedArray
+{
+public:
+    PackedArray() : mWidth(0), mCount(0) {}
+
+    static uint8_t widthFor(uint64_t maxValue);
+
+    void reset(uint64_t maxValue, size_t count);
+    void set(size_t index, uint64_t value);
+    uint64_t get(size_t index) const;
+
+    size_t size() const { return mCount; }
+    size_t memoryFootprint() const { return mBytes.capacity(); }
+
+private:
+    uint8_t mWidth;
+    size_t mCount;
+    std::vector<uint8_t> mBytes;
+};
+
+/*
+ * Decode times kept as the stts runs plus the time and sample index each
+ * run starts at, so both directions are a binary search over runs.
+ * Sample indices are 0-based.
+ */
+class SampleTimeIndex
+{
+public:
+    void build(const std::vector<sttsEntry>& stts);
+
+    uint32_t sampleCount() const { return mRuns.empty() ? 0 : mRuns.back().firstSample; }
+    uint64_t duration() const { return mRuns.empty() ? 0 : mRuns.back().firstTime; }
+
+    uint64_t sampleTime(uint32_t sample) const;
+    uint32_t sampleDelta(uint32_t sample) const;
+
+    // first sample whose time is >= t, sampleCount() if there is none
+    uint32_t firstSampleAtOrAfter(uint64_t t) const;
+    // last sample whose time is <= t
+    uint32_t lastSampleAtOrBefore(uint64_t t) const;
+
+    size_t memoryFootprint() const { return mRuns.capacity() * sizeof(Run); }
+
+private:
+    struct Run
+    {
+        uint32_t firstSample;
+        uint32_t delta;
+        uint64_t firstTime;
+    };
+
+    size_t runOfSample(uint32_t sample) const;
+
+    // terminated by a run with delta 0 that starts at sampleCount()
+    std::vector<Run> mRuns;
+};
+
+/*
+ * stsz as a single constant, as runs of equal sizes or packed per sample,
+ * whichever is smallest.
+ */
+class SampleSizeTable
+{
+public:
+    SampleSizeTable() : mConstantSize(0), mCount(0) {}
+
+    void build(const std::vector<int32_t>& stsz);
+
+    uint32_t sampleCount() const { return mCount; }
+    uint32_t sampleSize(uint32_t sample) const;
+    uint64_t rangeSize(uint32_t begin, uint32_t end) const;
+
+    size_t memoryFootprint() const;
+
+private:
+    struct Run
+    {
+        uint32_t firstSample;
+        uint32_t size;
+    };
+
+    uint32_t mConstantSize;
+    uint32_t mCount;
+    std::vector<Run> mRuns;
+    PackedArray mSizes;
+};
+
+/*
+ * Chunk offsets as packed deltas with an absolute checkpoint every
+ * CHECKPOINT_INTERVAL chunks, or as packed absolute offsets when the
+ * offsets are not increasing.
+ */
+class ChunkOffsetTable
+{
+public:
+    ChunkOffsetTable() : mDelta(false) {}
+
+    void build(const std::vector<stcoEntry>& stco);
+
+    uint32_t chunkCount() const { return mValues.size(); }
+    uint64_t chunkOffset(uint32_t chunk) const;
+
+    size_t memoryFootprint() const { return mValues.memoryFootprint() + mCheckpoints.capacity() * sizeof(uint64_t); }
+
+private:
+    enum { CHECKPOINT_INTERVAL = 32 };
+
+    bool mDelta;
+    PackedArray mValues;
+    std::vector<uint64_t> mCheckpoints;
+};
+
+/*
+ * The whole per-track index of a TrackInfo in compact form. All sample
+ * and chunk indices are 0-based.
+ */
+class CompactSampleTable
+{
+public:
+    int build(const TrackInfo *ti);
+
+    uint32_t sampleCount() const { return mSizes.sampleCount(); }
+    uint32_t sampleSize(uint32_t sample) const { return mSizes.sampleSize(sample); }
+    uint64_t sampleOffset(uint32_t sample) const;
+
+    const SampleTimeIndex& timeIndex() const { return mTimes; }
+    uint64_t sampleTime(uint32_t sample) const { return mTimes.sampleTime(sample); }
+    uint32_t sampleDelta(uint32_t sample) const { return mTimes.sampleDelta(sample); }
+
+    bool isKeyFrame(uint32_t sample) const;
+    uint32_t keyFrameAtOrBefore(uint32_t sample) const;
+
+    uint32_t chunkCount() const { return mChunkOffsets.chunkCount(); }
+    uint64_t chunkOffset(uint32_t chunk) const { return mChunkOffsets.chunkOffset(chunk); }
+    uint32_t chunkOfSample(uint32_t sample, uint32_t *firstSampleInChunk) const;
+
+    size_t memoryFootprint() const;
+
+private:
+    struct ChunkRun
+    {
+        uint32_t firstChunk;
+        uint32_t firstSample;
+        uint32_t samplesPerChunk;
+    };
+
+    SampleTimeIndex mTimes;
+    SampleSizeTable mSizes;
+    ChunkOffsetTable mChunkOffsets;
+    std::vector<ChunkRun> mChunkRuns;
+    std::vector<uint32_t> mKeyFrames; // stss, 1-based as in the file
+};
+
+#endif // MP4_SAMPLE_TABLE_H
@@ -0,0 +1,189 @@
+#include "mp4tabledecoder.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+using namespace std;
+
+static_assert(sizeof(sttsEntry) == 8, "sttsEntry must be two packed 32-bit words");
+static_assert(sizeof(cttsEntry) == 8, "cttsEntry must be two packed 32-bit words");
+
+static void
+DecodeBE32Scalar(const uint8_t *src, uint32_t *dst, size_t count)
+{
+    for (size_t i = 0; i < count; ++i, src += 4) {
+        dst[i] = ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+                 ((uint32_t)src[2] <<  8) |  (uint32_t)src[3];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static void
+DecodeBE32SSE2(const uint8_t *src, uint32_t *dst, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        // swap the bytes of every 16-bit lane, then the lanes of every word
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+    DecodeBE32Scalar(src + i * 4, dst + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void
+DecodeBE32AVX2(const uint8_t *src, uint32_t *dst, size_t count)
+{
+    const __m256i mask = _mm256_setr_epi8(
+                3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i * 4 + 32));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256((__m256i*)(dst + i + 8), _mm256_shuffle_epi8(b, mask));
+    }
+    for (; i + 8 <= count; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(a, mask));
+    }
+    DecodeBE32Scalar(src + i * 4, dst + i, count - i);
+}
+
+#endif // HAVE_X86_SIMD
+
+typedef void (*DecodeBE32Func)(const uint8_t*, uint32_t*, size_t);
+
+struct TableDecoder
+{
+    DecodeBE32Func mDecode;
+    const char *mName;
+
+    TableDecoder()
+        : mDecode(DecodeBE32Scalar)
+        , mName("scalar")
+    {
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            mDecode = DecodeBE32AVX2;
+            mName = "avx2";
+        }
+        else if (__builtin_cpu_supports("sse2")) {
+            mDecode = DecodeBE32SSE2;
+            mName = "sse2";
+        }
+#endif
+    }
+};
+
+static const TableDecoder&
+GetTableDecoder()
+{
+    static TableDecoder decoder;
+    return decoder;
+}
+
+void
+DecodeBE32Array(const void *src, uint32_t *dst, size_t count)
+{
+    GetTableDecoder().mDecode((const uint8_t*)src, dst, count);
+}
+
+const char*
+TableDecoderName()
+{
+    return GetTableDecoder().mName;
+}
+
+void
+DecodeSttsEntries(const void *data, uint32_t count, vector<sttsEntry>& out)
+{
+    out.resize(count);
+    if (count) {
+        DecodeBE32Array(data, (uint32_t*)&out[0], (size_t)count * 2);
+    }
+}
+
+void
+DecodeCttsEntries(const void *data, uint32_t count, vector<cttsEntry>& out)
+{
+    out.resize(count);
+    if (count) {
+        DecodeBE32Array(data, (uint32_t*)&out[0], (size_t)count * 2);
+    }
+}
+
+void
+DecodeStssEntries(const void *data, uint32_t count, vector<int32_t>& out)
+{
+    out.resize(count);
+    if (count) {
+        DecodeBE32Array(data, (uint32_t*)&out[0], count);
+    }
+}
+
+void
+DecodeStszEntries(const void *data, uint32_t count, vector<int32_t>& out)
+{
+    out.resize(count);
+    if (count) {
+        DecodeBE32Array(data, (uint32_t*)&out[0], count);
+    }
+}
+
+void
+DecodeStscEntries(const void *data, uint32_t count, vector<stscEntry>& out)
+{
+    // first chunk, samples per chunk, sample description index
+    vector<uint32_t> words((size_t)count * 3);
+    if (count) {
+        DecodeBE32Array(data, &words[0], words.size());
+    }
+
+    out.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        out[i].firstChunkIndex = words[i * 3];
+        out[i].samplesPerChunk = words[i * 3 + 1];
+    }
+}
+
+void
+DecodeStcoEntries(const void *data, uint32_t count, vector<stcoEntry>& out)
+{
+    vector<uint32_t> words(count);
+    if (count) {
+        DecodeBE32Array(data, &words[0], count);
+    }
+
+    out.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        out[i].firstSampleIndex = -1;
+        out[i].chunkOffset = words[i];
+    }
+}
+
+void
+DecodeCo64Entries(const void *data, uint32_t count, vector<stcoEntry>& out)
+{
+    vector<uint32_t> words((size_t)count * 2);
+    if (count) {
+        DecodeBE32Array(data, &words[0], words.size());
+    }
+
+    out.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        out[i].firstSampleIndex = -1;
+        out[i].chunkOffset = ((uint64_t)words[i * 2] << 32) | words[i * 2 + 1];
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef MP4_TABLE_DECODER_H
+#define MP4_TABLE_DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+#include "mp4trimmer.h"
+
+/*
+ * Convert count big-endian 32-bit words at src into host order at dst.
+ * Neither pointer needs to be aligned and dst may be equal to src.
+ * The implementation (AVX2, SSE2 or scalar) is picked once at runtime.
+ */
+void DecodeBE32Array(const void *src, uint32_t *dst, size_t count);
+
+const char* TableDecoderName();
+
+/*
+ * Bulk decoders for the entry arrays of the sample tables; data points
+ * right after the entry count and must hold count entries. Each output
+ * vector is sized once from count.
+ */
+void DecodeSttsEntries(const void *data, uint32_t count, std::vector<sttsEntry>& out);
+void DecodeCttsEntries(const void *data, uint32_t count, std::vector<cttsEntry>& out);
+void DecodeStssEntries(const void *data, uint32_t count, std::vector<int32_t>& out);
+void DecodeStszEntries(const void *data, uint32_t count, std::vector<int32_t>& out);
+void DecodeStscEntries(const void *data, uint32_t count, std::vector<stscEntry>& out);
+void DecodeStcoEntries(const void *data, uint32_t count, std::vector<stcoEntry>& out);
+void DecodeCo64Entries(const void *data, uint32_t count, std::vector<stcoEntry>& out);
+
+#endif // MP4_TABLE_DECODER_H
@@ -1,9 +1,19 @@
 #include "mp4trimmer.h"
 #include "mp4rewriter.h"
+#include "mp4tabledecoder.h"
+#include "mp4indexcache.h"
+#include "mp4sampletable.h"
 
 
 #include <algorithm>
 
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 using namespace std;
 
 #ifdef __ANDROID__
@@ -92,11 +102,6 @@ using namespace std;
 #define COPY_BUFFER_SIZE      (256 * 1024)
 
 
-bool compareTimeTableEntry(const TimeTableEntry& a, int32_t timestamp)
-{
-    return a.mTimestamp < timestamp;
-}
-
 int16_t read_int16(FILE *f)
 {
     char buff[2];
@@ -116,10 +121,28 @@ void skipNBytes(FILE *imp4, int step)
     fseeko(imp4, step, SEEK_CUR);
 }
 
-MP4Info*
-ExtractMP4Info(string filePath)
+static void DeleteTrackInfo(TrackInfo *ti);
+
+// one fread() for a whole table, decoded afterwards by the bulk decoders;
+// false when it would overrun the room left in its box or the file ends
+static bool readTable(FILE *f, uint64_t bytes, off_t room, vector<uint8_t>& buff)
+{
+    if (room < 0 || bytes > (uint64_t)room) {
+        _E("table of %llu bytes overruns its box \n", (unsigned long long)bytes);
+        return false;
+    }
+    buff.resize(bytes);
+    if (bytes && fread(&buff[0], bytes, 1, f) != 1) {
+        _E("table of %llu bytes cut short \n", (unsigned long long)bytes);
+        return false;
+    }
+    return true;
+}
+
+static MP4Info*
+ExtractMP4InfoStream(string filePath)
 {
-    MP4Info *mp4info = new MP4Info;
+    MP4Info *mp4info = new MP4Info();
     mp4info->mFilePath = filePath;
 
     unsigned char atom_bytes[ATOM_PREAMBLE_SIZE];
@@ -128,9 +151,16 @@ ExtractMP4Info(string filePath)
 
 
     TrackInfo *ti = NULL;
+    vector<uint8_t> table;
+    bool ok = true;
 
     FILE *imp4 = fopen(filePath.c_str(), "rb");
-    
+    if (imp4 == NULL) {
+        _E("open %s failed \n", filePath.c_str());
+        delete mp4info;
+        return NULL;
+    }
+
     while (!feof(imp4)) {
         long position = ftell(imp4);
 
@@ -167,6 +197,7 @@ ExtractMP4Info(string filePath)
         case MDAT_ATOM:
             mp4info->mdatOffset = position;
             mp4info->mdatSize = atom_size;
+            mp4info->mdatHeaderSize = case64 ? ATOM_PREAMBLE_SIZE * 2 : ATOM_PREAMBLE_SIZE;
             doSeek = true;
             break;
 
@@ -192,12 +223,16 @@ ExtractMP4Info(string filePath)
         }
 
         case TRAK_ATOM:
-            ti = new TrackInfo;
+            ti = new TrackInfo();
             doSeek = false;
             break;
 
         case TKHD_ATOM:
         {
+            if (ti == NULL) {
+                ok = false;
+                break;
+            }
             read_int32(imp4); // _
             read_int32(imp4); // creationTime
             read_int32(imp4); // modificationTime
@@ -218,6 +253,10 @@ ExtractMP4Info(string filePath)
 
         case MDHD_ATOM:
         {
+            if (ti == NULL) {
+                ok = false;
+                break;
+            }
             read_int32(imp4); // _
             read_int32(imp4); // creationTime
             read_int32(imp4); // modificationTime
@@ -230,6 +269,10 @@ ExtractMP4Info(string filePath)
 
         case HDLR_ATOM:
         {
+            if (ti == NULL) {
+                ok = false;
+                break;
+            }
             read_int32(imp4); // _
             read_int32(imp4); // component type, should be mhlr
             int32_t handler = read_int32(imp4); // handler | component subtype
@@ -276,6 +319,10 @@ ExtractMP4Info(string filePath)
 
         case AVC1_ATOM:
         {
+            if (ti == NULL) {
+                ok = false;
+                break;
+            }
             // 32 reserved
             // 16 reserved
             // 16 data ref index
@@ -288,7 +335,7 @@ ExtractMP4Info(string filePath)
 
             ti->avcWidth = read_int16(imp4);
             ti->avcHeight = read_int16(imp4);
-            _I("avc-widht:%d, avc-height:%d | %llu\n", (int)ti->avcWidth, (int)ti->avcHeight, atom_size);
+            _I("avc-widht:%d, avc-height:%d | %llu\n", (int)ti->avcWidth, (int)ti->avcHeight, (unsigned long long)atom_size);
 
 
             // skipNBytes(imp4, atom_size - 8 - 24 - 4);
@@ -308,6 +355,10 @@ ExtractMP4Info(string filePath)
 
         case AVCC_ATOM:
         {
+            if (ti == NULL) {
+                ok = false;
+                break;
+            }
             ti->avcCodecSpecLen = atom_size - 8;
             ti->avcCodecSpec = new char[ti->avcCodecSpecLen];
             fread(ti->avcCodecSpec, ti->avcCodecSpecLen, 1, imp4);
@@ -319,6 +370,10 @@ ExtractMP4Info(string filePath)
             break;
 
         case MP4A_ATOM:
+            if (ti == NULL) {
+                ok = false;
+                break;
+            }
             ti->codecSpecDataLen = atom_size - 8;
             ti->codecSpecData = new char[ti->codecSpecDataLen];
             fread(ti->codecSpecData, ti->codecSpecDataLen, 1, imp4);
@@ -329,15 +384,13 @@ ExtractMP4Info(string filePath)
         {
             int32_t _ = read_int32(imp4);
             (void)_;
-            int32_t count = read_int32(imp4);
+            uint32_t count = read_int32(imp4);
             _I("stts count: %d\n", count);
-            for (int  i = 0; i < count; ++i) {
-                sttsEntry entry;
-                entry.count = read_int32(imp4);
-                entry.delta = read_int32(imp4);
-                ti->stts.push_back(entry);
-                _I("    %d - %d\n", entry.count, entry.delta);
+            if (ti == NULL || !readTable(imp4, (uint64_t)count * 8, step - 8, table)) {
+                ok = false;
+                break;
             }
+            DecodeSttsEntries(table.data(), count, ti->stts);
             doSeek = false;
             break;
         }
@@ -346,15 +399,14 @@ ExtractMP4Info(string filePath)
         {
             int32_t _ = read_int32(imp4);
             (void)_;
-            int32_t count = read_int32(imp4);
+            uint32_t count = read_int32(imp4);
             _I("ctts count: %d\n", count);
-            for (int i = 0; i < count; ++i) {
-                cttsEntry entry;
-                entry.count = read_int32(imp4);
-                entry.delta = read_int32(imp4);
-                ti->ctts.push_back(entry);
-                _I("    %d - %d\n", entry.count, entry.delta);
+            if (ti == NULL || !readTable(imp4, (uint64_t)count * 8, step - 8, table)) {
+                ok = false;
+                break;
             }
+            DecodeCttsEntries(table.data(), count, ti->ctts);
+            doSeek = false;
             break;
         }
 
@@ -362,14 +414,13 @@ ExtractMP4Info(string filePath)
         {
             int32_t _ = read_int32(imp4);
             (void)_;
-            int32_t count = read_int32(imp4);
-            _I("stss: ");
-            for (int i = 0; i < count; ++i) {
-                int32_t keyFrameIndex = read_int32(imp4);
-                ti->stss.push_back(keyFrameIndex);
-                _I("%d, ", keyFrameIndex);
-            }
-            _I("\n\n");
+            uint32_t count = read_int32(imp4);
+            _I("stss count: %d\n", count);
+            if (ti == NULL || !readTable(imp4, (uint64_t)count * 4, step - 8, table)) {
+                ok = false;
+                break;
+            }
+            DecodeStssEntries(table.data(), count, ti->stss);
             doSeek = false;
             break;
         }
@@ -380,11 +431,21 @@ ExtractMP4Info(string filePath)
             (void)_0;
             int32_t _1 = read_int32(imp4);
             (void)_1;
-            int32_t count = read_int32(imp4);
+            uint32_t count = read_int32(imp4);
             _I("%d -- %d -- %d \n", _0, _1, count);
-            for (int i = 0; i < count; ++i) {
-                uint32_t sampleSize = read_int32(imp4);
-                ti->stsz.push_back(sampleSize);
+            if (ti == NULL) {
+                ok = false;
+                break;
+            }
+            if (_1 != 0) {
+                ti->stsz.assign(count, _1);
+            }
+            else {
+                if (!readTable(imp4, (uint64_t)count * 4, step - 12, table)) {
+                    ok = false;
+                    break;
+                }
+                DecodeStszEntries(table.data(), count, ti->stsz);
             }
             doSeek = false;
             break;
@@ -394,15 +455,12 @@ ExtractMP4Info(string filePath)
         {
             int32_t _ = read_int32(imp4);
             (void)_;
-            int32_t count = read_int32(imp4);
-            for (int i = 0; i < count; ++i) {
-                stscEntry entry;
-                entry.firstChunkIndex = read_int32(imp4);
-                entry.samplesPerChunk = read_int32(imp4);
-                int32_t _ = read_int32(imp4);
-                (void)_;
-                ti->stsc.push_back(entry);
+            uint32_t count = read_int32(imp4);
+            if (ti == NULL || !readTable(imp4, (uint64_t)count * 12, step - 8, table)) {
+                ok = false;
+                break;
             }
+            DecodeStscEntries(table.data(), count, ti->stsc);
             doSeek = false;
             break;
         }
@@ -411,13 +469,12 @@ ExtractMP4Info(string filePath)
         {
             int32_t _ = read_int32(imp4);
             (void)_;
-            int32_t count = read_int32(imp4);
-            for (int i = 0; i < count; ++i) {
-                stcoEntry entry;
-                entry.firstSampleIndex = -1;
-                entry.chunkOffset = read_int32(imp4);
-                ti->stco.push_back(entry);
+            uint32_t count = read_int32(imp4);
+            if (ti == NULL || !readTable(imp4, (uint64_t)count * 4, step - 8, table)) {
+                ok = false;
+                break;
             }
+            DecodeStcoEntries(table.data(), count, ti->stco);
 #if 0
             int32_t fakeOffset = mp4info->mdatOffset + mp4info->mdatSize - 8;
             _I("fake stco entry with size %d insert into %lu\n", fakeOffset, ti->stco.size() - 1);
@@ -427,273 +484,1747 @@ ExtractMP4Info(string filePath)
             break;
         }
 
+        case CO64_ATOM:
+        {
+            int32_t _ = read_int32(imp4);
+            (void)_;
+            uint32_t count = read_int32(imp4);
+            if (ti == NULL || !readTable(imp4, (uint64_t)count * 8, step - 8, table)) {
+                ok = false;
+                break;
+            }
+            DecodeCo64Entries(table.data(), count, ti->stco);
+            doSeek = false;
+            break;
+        }
+
         default:
             _I("unknown box type %02x %02x %02x %02x\n", atom_bytes[4], atom_bytes[5], atom_bytes[6], atom_bytes[7]);
             break;
         }
 
+        if (!ok) {
+            break;
+        }
+
         if (doSeek == true) {
             fseeko(imp4, step, SEEK_CUR);
         }
     }
+    fclose(imp4);
+
+    if (!ok) {
+        _E("parse moov of %s failed \n", filePath.c_str());
+        if (ti != mp4info->mVideoTrackInfo && ti != mp4info->mAudioTrackInfo) {
+            DeleteTrackInfo(ti);
+        }
+        DeleteTrackInfo(mp4info->mVideoTrackInfo);
+        DeleteTrackInfo(mp4info->mAudioTrackInfo);
+        delete mp4info;
+        return NULL;
+    }
     return mp4info;
 }
 
-static int
-BuildTimeTable(MP4Info *mp4info)
+/*
+ * Bounds-checked big-endian reader over a memory range. Every load past
+ * the end of the range yields 0 and latches mError, so a truncated or
+ * corrupted box can never walk the parser outside the mapping.
+ */
+struct BoxReader
 {
-    TrackInfo *ti = mp4info->mVideoTrackInfo;
+    const uint8_t *mData;
+    uint64_t mSize;
+    uint64_t mPos;
+    bool mError;
 
-#if 0
-    {
-        // fake entry
-        TimeTableEntry entry;
-        entry.mID = 0;
-        entry.mTimestamp = 0;
-        entry.mIsKeyFrame = false;
-        ti->mTimeTable.push_back(entry);
-    }
-#endif
+    BoxReader(const uint8_t *data, uint64_t size)
+        : mData(data), mSize(size), mPos(0), mError(false)
+    {}
 
-    vector<int32_t>::iterator nextKeyFrameIDIterator = ti->stss.begin();
-    int32_t nextKeyFrameID = *nextKeyFrameIDIterator;
-
-    uint32_t id = 0;
-    uint64_t timestamp = 0;
-    for (vector<sttsEntry>::iterator it = ti->stts.begin(); it != ti->stts.end(); ++it) {
-        for (int i = 0; i < it->count; ++i) {
-            TimeTableEntry entry;
-            entry.mID = ++id;
-            entry.mTimestamp = timestamp;
-            timestamp += it->delta;
-            entry.mIsKeyFrame = false;
-            if (entry.mID == nextKeyFrameID) {
-                entry.mIsKeyFrame = true;
-                if (++nextKeyFrameIDIterator != ti->stss.end()) {
-                    nextKeyFrameID = *nextKeyFrameIDIterator;
-                }
-            }
-            
-            ti->mTimeTable.push_back(entry);
+    uint64_t remain() const { return mSize - mPos; }
+    bool has(uint64_t n) const { return !mError && n <= mSize - mPos; }
+
+    const uint8_t* take(uint64_t n)
+    {
+        if (!has(n)) {
+            mError = true;
+            return NULL;
         }
+        const uint8_t *p = mData + mPos;
+        mPos += n;
+        return p;
     }
 
+    void skip(uint64_t n) { take(n); }
+
+    uint8_t readInt8() { const uint8_t *p = take(1); return p ? p[0] : 0; }
+    uint16_t readInt16() { const uint8_t *p = take(2); return p ? BE_16(p) : 0; }
+    uint32_t readInt32() { const uint8_t *p = take(4); return p ? BE_32(p) : 0; }
+    uint64_t readInt64() { const uint8_t *p = take(8); return p ? BE_64(p) : 0; }
+
+    BoxReader sub(uint64_t n)
     {
-        // fake entry
-        TimeTableEntry fakeEntry;
-        fakeEntry.mID = ++id;
-#if 1
-        fakeEntry.mTimestamp = timestamp;
-#else
-        fakeEntry.mTimestamp = numeric_limits<uint64_t>::max();
-#endif
-        fakeEntry.mIsKeyFrame = false;
-        ti->mTimeTable.push_back(fakeEntry);
+        const uint8_t *p = take(n);
+        BoxReader r(p, p ? n : 0);
+        r.mError = (p == NULL);
+        return r;
     }
+};
 
-    return 0;
+static void
+DeleteTrackInfo(TrackInfo *ti)
+{
+    if (ti != NULL) {
+        delete [] ti->avcCodecSpec;
+        delete [] ti->codecSpecData;
+        delete ti;
+    }
 }
 
-static int
-PerformTrim(MP4Info *mp4info, const char* dest)
+static void
+DeleteMP4Info(MP4Info *mp4info)
 {
-    MP4Rewriter writer;
-    writer.setOutputPath(dest);
-    writer.open();
-    writer.write(mp4info);
-    writer.close();
-
-    return 0;
+    DeleteTrackInfo(mp4info->mVideoTrackInfo);
+    DeleteTrackInfo(mp4info->mAudioTrackInfo);
+    delete mp4info;
 }
 
-int mp4trim(const char* src, const char* dest, int beginMs, int ceaseMs)
+static bool
+ParseMappedBoxes(BoxReader& r, MP4Info *mp4info, TrackInfo *&ti)
 {
-    if (beginMs < 0) {
-        beginMs = 0;
-    }
+    while (r.remain() >= ATOM_PREAMBLE_SIZE) {
+        const uint8_t *atom_bytes = r.take(ATOM_PREAMBLE_SIZE);
+        uint64_t atom_size = (uint32_t) BE_32(&atom_bytes[0]);
+        uint32_t atom_type = BE_32(&atom_bytes[4]);
+        uint64_t header_size = ATOM_PREAMBLE_SIZE;
 
-    if (ceaseMs < 0) {
-        ceaseMs = -1;
-    }
+        if (atom_size == 1) { /* 64-bit special case */
+            atom_size = r.readInt64();
+            header_size += 8;
+        }
+        else if (atom_size == 0) { /* box extends to the end of its parent */
+            atom_size = r.remain() + header_size;
+        }
 
-    MP4Info *mp4info = ExtractMP4Info(src);
-    _I("mp4 duration: %dms, GOPs:%lu \n", mp4info->duration, mp4info->mVideoTrackInfo->stss.size());
+        if (r.mError || atom_size < header_size || atom_size - header_size > r.remain()) {
+            _E("malformed box %c%c%c%c \n", atom_bytes[4], atom_bytes[5], atom_bytes[6], atom_bytes[7]);
+            return false;
+        }
 
+        BoxReader box = r.sub(atom_size - header_size);
 
-    stcoEntry fakeStcoEntry;
-    fakeStcoEntry.firstSampleIndex = -1;
-    fakeStcoEntry.chunkOffset = mp4info->mdatOffset + mp4info->mdatSize;
-    _I("fake stco entry with size %d\n", fakeStcoEntry.chunkOffset);
-    mp4info->mVideoTrackInfo->stco.push_back(fakeStcoEntry);
-    mp4info->mAudioTrackInfo->stco.push_back(fakeStcoEntry);
+        switch (atom_type)
+        {
+        case MOOV_ATOM:
+        case MDIA_ATOM:
+        case MINF_ATOM:
+        case STBL_ATOM:
+            if (!ParseMappedBoxes(box, mp4info, ti)) {
+                return false;
+            }
+            break;
 
-    _I("video stco -- %ld \n", mp4info->mVideoTrackInfo->stco.size());
-    _I("audio stco -- %ld \n", mp4info->mAudioTrackInfo->stco.size());
+        case TRAK_ATOM:
+        {
+            ti = new TrackInfo();
+            bool ok = ParseMappedBoxes(box, mp4info, ti);
+            if (ti != mp4info->mVideoTrackInfo && ti != mp4info->mAudioTrackInfo) {
+                // neither vide nor soun, e.g. a timecode or hint track
+                DeleteTrackInfo(ti);
+            }
+            ti = NULL;
+            if (!ok) {
+                return false;
+            }
+            break;
+        }
 
-    {
-        auto it = mp4info->mVideoTrackInfo->stsc.begin();
-        if (it == mp4info->mVideoTrackInfo->stsc.end()) {
-            _E("video track has no stsc info!\n");
-            return -9527;
+        case MVHD_ATOM:
+        {
+            uint8_t version = box.readInt8();
+            box.skip(3);                                // flags
+            box.skip(version == 1 ? 16 : 8);            // creationTime, modificationTime
+            mp4info->timeScale = box.readInt32();
+            mp4info->duration = version == 1 ? box.readInt64() : box.readInt32();
+            box.skip(76);
+            mp4info->trackCount = box.readInt32();
+            mp4info->trackCount--;
+            break;
         }
 
-        int c = 0;
-        int i = 0;
-        while (it != mp4info->mVideoTrackInfo->stsc.end()) {
-            auto itn = it + 1;
-            int cc = mp4info->mVideoTrackInfo->stco.size();
-            if (itn != mp4info->mVideoTrackInfo->stsc.end()) {
-                cc = itn->firstChunkIndex - 1;
-                // TODO if stco.size() < itn->firstChunkIndex
+        case TKHD_ATOM:
+        {
+            if (ti == NULL) {
+                break;
             }
-            while (c < cc) {
-                mp4info->mVideoTrackInfo->stco[c++].firstSampleIndex = i;
-                i += it->samplesPerChunk;
+            uint8_t version = box.readInt8();
+            box.skip(3);                                // flags
+            box.skip(version == 1 ? 16 : 8);            // creationTime, modificationTime
+            ti->trackID = box.readInt32();
+            box.skip(4);                                // reserved
+            ti->duration = version == 1 ? box.readInt64() : box.readInt32();
+            // width and height are the last two fields of the box
+            if (box.remain() >= 8) {
+                box.skip(box.remain() - 8);
             }
-            it = itn;
+            ti->_width = box.readInt32();
+            ti->_height = box.readInt32();
+            break;
         }
-    }
 
-    {
-        auto it = mp4info->mAudioTrackInfo->stsc.begin();
-        if (it == mp4info->mAudioTrackInfo->stsc.end()) {
-            _E("audio track has no stsc info!\n");
-            return -9528;
+        case MDHD_ATOM:
+        {
+            if (ti == NULL) {
+                break;
+            }
+            uint8_t version = box.readInt8();
+            box.skip(3);                                // flags
+            box.skip(version == 1 ? 16 : 8);            // creationTime, modificationTime
+            ti->timeScale = box.readInt32();
+            break;
         }
 
-        int c = 0;
-        int i = 0;
-        while (it != mp4info->mAudioTrackInfo->stsc.end()) {
-            auto itn = it + 1;
-            int cc = mp4info->mAudioTrackInfo->stco.size() - 1;
-            if (itn != mp4info->mAudioTrackInfo->stsc.end()) {
-                cc = itn->firstChunkIndex - 1;
-                // TODO if stco.size() < itn->firstChunkIndex
+        case HDLR_ATOM:
+        {
+            if (ti == NULL) {
+                break;
+            }
+            box.skip(8);                                // _, component type
+            uint32_t handler = box.readInt32();
+            if (handler == VIDE_FOURCC) {
+                ti->mIsVideo = true;
+                mp4info->mVideoTrackInfo = ti;
             }
-            while (c < cc) {
-                mp4info->mAudioTrackInfo->stco[c++].firstSampleIndex = i;
-                i += it->samplesPerChunk;
+            else if (handler == SOUN_FOURCC) {
+                ti->mIsVideo = false;
+                mp4info->mAudioTrackInfo = ti;
             }
-            it = itn;
+            break;
         }
-    }
-
-
-    BuildTimeTable(mp4info);
-    _I("time table entry count: %lu \n", mp4info->mVideoTrackInfo->mTimeTable.size());
-
-    _I("time scale: %d \n", mp4info->mVideoTrackInfo->timeScale);
 
+        case STSD_ATOM:
+            box.skip(8);                                // _, entry count
+            if (!ParseMappedBoxes(box, mp4info, ti)) {
+                return false;
+            }
+            break;
 
-    TrackInfo* videoInfo = mp4info->mVideoTrackInfo;
+        case AVC1_ATOM:
+            if (ti == NULL) {
+                break;
+            }
+            box.skip(24);
+            ti->avcWidth = box.readInt16();
+            ti->avcHeight = box.readInt16();
+            box.skip(50);
+            if (!ParseMappedBoxes(box, mp4info, ti)) {
+                return false;
+            }
+            break;
 
+        case AVCC_ATOM:
+            if (ti == NULL) {
+                break;
+            }
+            delete [] ti->avcCodecSpec;
+            ti->avcCodecSpecLen = box.remain();
+            ti->avcCodecSpec = new char[ti->avcCodecSpecLen];
+            memcpy(ti->avcCodecSpec, box.take(box.remain()), ti->avcCodecSpecLen);
+            break;
 
-    // begin = beginMs / 1000 * 90000
-    uint64_t begin = beginMs * (videoInfo->timeScale / 1000);
-    vector<TimeTableEntry>::iterator beginIt = lower_bound(
-                                    videoInfo->mTimeTable.begin(),
-                                    videoInfo->mTimeTable.end(),
-                                    begin, compareTimeTableEntry);
-    _I("begin: %d|%llu -- %d -- %llu -- %s\n",beginMs, begin, beginIt->mID, beginIt->mTimestamp, (beginIt->mIsKeyFrame ? "true" : "false"));
-    mp4info->trimBeginID0 = beginIt->mID;
+        case MP4A_ATOM:
+            if (ti == NULL) {
+                break;
+            }
+            delete [] ti->codecSpecData;
+            ti->codecSpecDataLen = box.remain();
+            ti->codecSpecData = new char[ti->codecSpecDataLen];
+            memcpy(ti->codecSpecData, box.take(box.remain()), ti->codecSpecDataLen);
+            break;
 
+        case STTS_ATOM:
+        {
+            if (ti == NULL) {
+                break;
+            }
+            box.skip(4);
+            uint32_t count = box.readInt32();
+            if (!box.has((uint64_t)count * 8)) {
+                return false;
+            }
+            DecodeSttsEntries(box.take((uint64_t)count * 8), count, ti->stts);
+            break;
+        }
 
-    // cease = ceaseMs / 1000 * 90000
-    if (ceaseMs != -1) {
-        uint64_t cease = ceaseMs * (videoInfo->timeScale / 1000);
-        vector<TimeTableEntry>::iterator ceaseIt = lower_bound(
-                                        videoInfo->mTimeTable.begin(),
-                                        videoInfo->mTimeTable.end(),
-                                        cease, compareTimeTableEntry);
-        if (ceaseIt == videoInfo->mTimeTable.end()) {
-            --ceaseIt;
+        case CTTS_ATOM:
+        {
+            if (ti == NULL) {
+                break;
+            }
+            box.skip(4);
+            uint32_t count = box.readInt32();
+            if (!box.has((uint64_t)count * 8)) {
+                return false;
+            }
+            DecodeCttsEntries(box.take((uint64_t)count * 8), count, ti->ctts);
+            break;
         }
-        _I("cease: %d|%llu -- %d -- %llu -- %s\n", ceaseMs, cease, ceaseIt->mID, ceaseIt->mTimestamp, (ceaseIt->mIsKeyFrame ? "true" : "false"));
-        mp4info->trimCeaseID0 = ceaseIt->mID;
-    }
-    else {
-        mp4info->trimCeaseID0 = -1;
-    }
 
+        case STSS_ATOM:
+        {
+            if (ti == NULL) {
+                break;
+            }
+            box.skip(4);
+            uint32_t count = box.readInt32();
+            if (!box.has((uint64_t)count * 4)) {
+                return false;
+            }
+            DecodeStssEntries(box.take((uint64_t)count * 4), count, ti->stss);
+            break;
+        }
 
-    mp4info->trimBeginVideoID = mp4info->trimBeginID0;
-    for (; mp4info->trimBeginVideoID && !videoInfo->mTimeTable[mp4info->trimBeginVideoID - 1].mIsKeyFrame; --mp4info->trimBeginVideoID)
-    {}
+        case STSZ_ATOM:
+        {
+            if (ti == NULL) {
+                break;
+            }
+            box.skip(4);
+            uint32_t sampleSize = box.readInt32();
+            uint32_t count = box.readInt32();
+            if (sampleSize != 0) {
+                ti->stsz.assign(count, sampleSize);
+                break;
+            }
+            if (!box.has((uint64_t)count * 4)) {
+                return false;
+            }
+            DecodeStszEntries(box.take((uint64_t)count * 4), count, ti->stsz);
+            break;
+        }
 
-    if (mp4info->trimCeaseID0 != -1) {
-        mp4info->trimCeaseVideoID = mp4info->trimCeaseID0;
-    }
-    else {
-        mp4info->trimCeaseVideoID = videoInfo->mTimeTable.size() - 1;
-    }
+        case STSC_ATOM:
+        {
+            if (ti == NULL) {
+                break;
+            }
+            box.skip(4);
+            uint32_t count = box.readInt32();
+            if (!box.has((uint64_t)count * 12)) {
+                return false;
+            }
+            DecodeStscEntries(box.take((uint64_t)count * 12), count, ti->stsc);
+            break;
+        }
 
+        case STCO_ATOM:
+        {
+            if (ti == NULL) {
+                break;
+            }
+            box.skip(4);
+            uint32_t count = box.readInt32();
+            if (!box.has((uint64_t)count * 4)) {
+                return false;
+            }
+            DecodeStcoEntries(box.take((uint64_t)count * 4), count, ti->stco);
+            break;
+        }
 
-    // TODO HEERE
+        case CO64_ATOM:
+        {
+            if (ti == NULL) {
+                break;
+            }
+            box.skip(4);
+            uint32_t count = box.readInt32();
+            if (!box.has((uint64_t)count * 8)) {
+                return false;
+            }
+            DecodeCo64Entries(box.take((uint64_t)count * 8), count, ti->stco);
+            break;
+        }
 
-    stcoVectorIterator cb = upper_bound(
-                mp4info->mVideoTrackInfo->stco.begin(),
-                mp4info->mVideoTrackInfo->stco.end(),
-                mp4info->trimBeginVideoID - 1,
-                compareStcoSampleIndex);
-    --cb;
-    stcoVectorIterator ce = upper_bound(
-                mp4info->mVideoTrackInfo->stco.begin(),
-                mp4info->mVideoTrackInfo->stco.end(),
-                mp4info->trimCeaseVideoID - 1,
-                compareStcoSampleIndex);
-    --ce;
+        default:
+            break;
+        }
 
-    mp4info->trimBeginVideoChunk = cb;
-    mp4info->trimCeaseVideoChunk = ce;
+        if (box.mError) {
+            _E("truncated box %c%c%c%c \n", atom_bytes[4], atom_bytes[5], atom_bytes[6], atom_bytes[7]);
+            return false;
+        }
+    }
 
-    _I("cb: %d, %d, %d \n", mp4info->trimBeginVideoID, cb->firstSampleIndex, cb->chunkOffset);
-    _I("ce: %d, %d, %d \n", mp4info->trimCeaseVideoID, ce->firstSampleIndex, ce->chunkOffset);
+    return true;
+}
 
-    mp4info->trimBeginOffset = cb->chunkOffset;
-    for (auto i = cb->firstSampleIndex; i < mp4info->trimBeginVideoID - 1; ++i) {
-        mp4info->trimBeginOffset += mp4info->mVideoTrackInfo->stsz[i];
+/*
+ * Walk the top level boxes with one pread() per box header to find the
+ * moov and mdat ranges, then map just the moov and parse it in memory.
+ */
+static MP4Info*
+ExtractMP4InfoMapped(string filePath)
+{
+    int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        _E("open %s failed \n", filePath.c_str());
+        return NULL;
     }
 
-    mp4info->trimCeaseOffset = ce->chunkOffset;
-    for (auto i = ce->firstSampleIndex; i < mp4info->trimCeaseVideoID - 1; ++i) {
-        mp4info->trimCeaseOffset += mp4info->mVideoTrackInfo->stsz[i];
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return NULL;
     }
 
-    _I("media data: %lld --> %lld \n", mp4info->trimBeginOffset, mp4info->trimCeaseOffset);
+    MP4Info *mp4info = new MP4Info();
+    mp4info->mFilePath = filePath;
 
-    uint64_t timestampDelta = videoInfo->mTimeTable[mp4info->trimCeaseVideoID - 1].mTimestamp - videoInfo->mTimeTable[mp4info->trimBeginVideoID - 1].mTimestamp;
-    mp4info->postTrimDurationUs = timestampDelta * 1000000 / videoInfo->timeScale;
-    mp4info->postTrimDuration = (mp4info->postTrimDurationUs * mp4info->timeScale + 5E5) / 1E6;
+    off_t position = 0;
+    while (position + ATOM_PREAMBLE_SIZE <= st.st_size) {
+        unsigned char atom_bytes[ATOM_PREAMBLE_SIZE * 2];
+        ssize_t r = pread(fd, atom_bytes, sizeof(atom_bytes), position);
+        if (r < ATOM_PREAMBLE_SIZE) {
+            break;
+        }
+        uint64_t atom_size = (uint32_t) BE_32(&atom_bytes[0]);
+        uint32_t atom_type = BE_32(&atom_bytes[4]);
+        int32_t header_size = ATOM_PREAMBLE_SIZE;
+        if (atom_size == 1) {
+            if (r < ATOM_PREAMBLE_SIZE * 2) {
+                break;
+            }
+            atom_size = BE_64(&atom_bytes[8]);
+            header_size += 8;
+        }
+        else if (atom_size == 0) {
+            atom_size = st.st_size - position;
+        }
+        if (atom_size < ATOM_PREAMBLE_SIZE) {
+            break;
+        }
 
+        if (atom_type == MDAT_ATOM) {
+            mp4info->mdatOffset = position;
+            mp4info->mdatSize = atom_size;
+            mp4info->mdatHeaderSize = header_size;
+        }
+        else if (atom_type == MOOV_ATOM) {
+            mp4info->moovOffset = position;
+            mp4info->moovSize = atom_size;
+        }
+        position += atom_size;
+    }
+
+    if (mp4info->moovSize == 0 || mp4info->moovOffset + mp4info->moovSize > (uint64_t)st.st_size) {
+        _E("no complete moov in %s \n", filePath.c_str());
+        ::close(fd);
+        delete mp4info;
+        return NULL;
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    off_t mapOffset = mp4info->moovOffset - mp4info->moovOffset % pageSize;
+    size_t mapSize = mp4info->moovOffset - mapOffset + mp4info->moovSize;
+    void *map = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, mapOffset);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        _W("mmap %s failed, fall back to stream parsing \n", filePath.c_str());
+        delete mp4info;
+        return ExtractMP4InfoStream(filePath);
+    }
+    madvise(map, mapSize, MADV_SEQUENTIAL);
+
+    BoxReader reader((const uint8_t*)map + (mp4info->moovOffset - mapOffset), mp4info->moovSize);
+    TrackInfo *ti = NULL;
+    bool ok = ParseMappedBoxes(reader, mp4info, ti);
+    munmap(map, mapSize);
+
+    if (!ok) {
+        _E("parse moov of %s failed \n", filePath.c_str());
+        DeleteMP4Info(mp4info);
+        return NULL;
+    }
+
+    return mp4info;
+}
+
+#define LAZY_WINDOW_SIZE      (64 * 1024)
+
+/*
+ * A single pread() window over the file. Requests inside the window are
+ * served from memory; anything else refills the window at the requested
+ * offset, so walking box headers that sit close together costs one read.
+ */
+struct WindowedFile
+{
+    int mFD;
+    off_t mFileSize;
+    vector<uint8_t> mBuff;
+    off_t mBuffOffset;
+    int mReadCount;
+
+    WindowedFile(int fd, off_t fileSize)
+        : mFD(fd), mFileSize(fileSize), mBuffOffset(0), mReadCount(0)
+    {}
+
+    bool contains(off_t offset, uint64_t len) const
+    {
+        return offset >= mBuffOffset && offset + len <= mBuffOffset + mBuff.size();
+    }
+
+    const uint8_t* get(off_t offset, uint64_t len)
+    {
+        if (offset < 0 || offset + len > (uint64_t)mFileSize) {
+            return NULL;
+        }
+        if (!contains(offset, len)) {
+            uint64_t want = min<uint64_t>(max<uint64_t>(len, LAZY_WINDOW_SIZE), mFileSize - offset);
+            mBuff.resize(want);
+            mBuffOffset = offset;
+            ++mReadCount;
+            ssize_t r = pread(mFD, &mBuff[0], want, offset);
+            mBuff.resize(r > 0 ? r : 0);
+            if (!contains(offset, len)) {
+                return NULL;
+            }
+        }
+        return &mBuff[offset - mBuffOffset];
+    }
+};
+
+/*
+ * Camera style files put the moov last, so look for a moov box that ends
+ * exactly at the end of the file in the last window. On success the
+ * window is left holding the tail, which usually covers the whole moov.
+ */
+static bool
+ProbeTailForMoov(WindowedFile& wf, MP4Info *mp4info)
+{
+    off_t tailOffset = max<off_t>(wf.mFileSize - LAZY_WINDOW_SIZE, 0);
+    uint64_t tailLen = wf.mFileSize - tailOffset;
+    const uint8_t *tail = wf.get(tailOffset, tailLen);
+    if (tail == NULL || tailLen < ATOM_PREAMBLE_SIZE) {
+        return false;
+    }
+
+    for (uint64_t i = tailLen - ATOM_PREAMBLE_SIZE + 1; i-- > 0; ) {
+        if ((uint32_t) BE_32(&tail[i + 4]) != MOOV_ATOM) {
+            continue;
+        }
+        uint64_t atom_size = (uint32_t) BE_32(&tail[i]);
+        if (atom_size == 1 && i + 16 <= tailLen) {
+            atom_size = BE_64(&tail[i + 8]);
+        }
+        if (atom_size >= ATOM_PREAMBLE_SIZE && tailOffset + i + atom_size == (uint64_t)wf.mFileSize) {
+            mp4info->moovOffset = tailOffset + i;
+            mp4info->moovSize = atom_size;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+IsSampleTableAtom(uint32_t atom_type)
+{
+    switch (atom_type) {
+    case STTS_ATOM:
+    case CTTS_ATOM:
+    case STSS_ATOM:
+    case STSZ_ATOM:
+    case STSC_ATOM:
+    case STCO_ATOM:
+    case CO64_ATOM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Walk [begin, end) of the file box by box. Only the small boxes the
+ * parser needs are read; the sample tables are merely located and their
+ * span recorded in the track, to be decoded by LoadTrackTables().
+ */
+static bool
+ParseLazyBoxes(WindowedFile& wf, off_t begin, off_t end, MP4Info *mp4info, TrackInfo *&ti)
+{
+    off_t position = begin;
+    while (position + ATOM_PREAMBLE_SIZE <= end) {
+        const uint8_t *atom_bytes = wf.get(position, min<off_t>(end - position, ATOM_PREAMBLE_SIZE * 2));
+        if (atom_bytes == NULL) {
+            return false;
+        }
+        uint64_t atom_size = (uint32_t) BE_32(&atom_bytes[0]);
+        uint32_t atom_type = BE_32(&atom_bytes[4]);
+        uint64_t header_size = ATOM_PREAMBLE_SIZE;
+
+        if (atom_size == 1) {
+            if (end - position < ATOM_PREAMBLE_SIZE * 2) {
+                return false;
+            }
+            atom_size = BE_64(&atom_bytes[8]);
+            header_size += 8;
+        }
+        else if (atom_size == 0) {
+            atom_size = end - position;
+        }
+
+        if (atom_size < header_size || atom_size > (uint64_t)(end - position)) {
+            _E("malformed box %c%c%c%c \n", atom_bytes[4], atom_bytes[5], atom_bytes[6], atom_bytes[7]);
+            return false;
+        }
+
+        switch (atom_type)
+        {
+        case MDIA_ATOM:
+        case MINF_ATOM:
+        case STBL_ATOM:
+            if (!ParseLazyBoxes(wf, position + header_size, position + atom_size, mp4info, ti)) {
+                return false;
+            }
+            break;
+
+        case TRAK_ATOM:
+        {
+            ti = new TrackInfo();
+            ti->mTablesDeferred = true;
+            bool ok = ParseLazyBoxes(wf, position + header_size, position + atom_size, mp4info, ti);
+            if (ti != mp4info->mVideoTrackInfo && ti != mp4info->mAudioTrackInfo) {
+                DeleteTrackInfo(ti);
+            }
+            ti = NULL;
+            if (!ok) {
+                return false;
+            }
+            break;
+        }
+
+        case MVHD_ATOM:
+        case TKHD_ATOM:
+        case MDHD_ATOM:
+        case HDLR_ATOM:
+        case STSD_ATOM:
+        {
+            const uint8_t *data = wf.get(position, atom_size);
+            if (data == NULL) {
+                return false;
+            }
+            BoxReader reader(data, atom_size);
+            if (!ParseMappedBoxes(reader, mp4info, ti)) {
+                return false;
+            }
+            break;
+        }
+
+        default:
+            if (ti != NULL && IsSampleTableAtom(atom_type)) {
+                if (ti->mTablesSize == 0) {
+                    ti->mTablesOffset = position;
+                }
+                ti->mTablesSize = position + atom_size - ti->mTablesOffset;
+            }
+            break;
+        }
+
+        position += atom_size;
+    }
+
+    return true;
+}
+
+/*
+ * Find the moov with as few reads as possible: one window at the head of
+ * the file covers ftyp, the mdat header and a leading moov; failing that
+ * a probe of the tail finds a trailing moov; only then do we fall back to
+ * hopping from box header to box header.
+ */
+static MP4Info*
+ExtractMP4InfoLazy(string filePath)
+{
+    int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        _E("open %s failed \n", filePath.c_str());
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return NULL;
+    }
+
+    MP4Info *mp4info = new MP4Info();
+    mp4info->mFilePath = filePath;
+
+    WindowedFile wf(fd, st.st_size);
+    wf.get(0, min<off_t>(st.st_size, ATOM_PREAMBLE_SIZE * 2));
+    bool probedTail = false;
+
+    off_t position = 0;
+    while (mp4info->moovSize == 0 && position + ATOM_PREAMBLE_SIZE <= st.st_size) {
+        if (!probedTail && !wf.contains(position, ATOM_PREAMBLE_SIZE * 2)) {
+            probedTail = true;
+            if (ProbeTailForMoov(wf, mp4info)) {
+                break;
+            }
+        }
+
+        const uint8_t *atom_bytes = wf.get(position, min<off_t>(st.st_size - position, ATOM_PREAMBLE_SIZE * 2));
+        if (atom_bytes == NULL) {
+            break;
+        }
+        uint64_t atom_size = (uint32_t) BE_32(&atom_bytes[0]);
+        uint32_t atom_type = BE_32(&atom_bytes[4]);
+        int32_t header_size = ATOM_PREAMBLE_SIZE;
+        if (atom_size == 1 && st.st_size - position >= ATOM_PREAMBLE_SIZE * 2) {
+            atom_size = BE_64(&atom_bytes[8]);
+            header_size += 8;
+        }
+        else if (atom_size == 0) {
+            atom_size = st.st_size - position;
+        }
+        if (atom_size < ATOM_PREAMBLE_SIZE) {
+            break;
+        }
+
+        if (atom_type == MDAT_ATOM) {
+            mp4info->mdatOffset = position;
+            mp4info->mdatSize = atom_size;
+            mp4info->mdatHeaderSize = header_size;
+        }
+        else if (atom_type == MOOV_ATOM) {
+            mp4info->moovOffset = position;
+            mp4info->moovSize = atom_size;
+        }
+        position += atom_size;
+    }
+
+    if (mp4info->moovSize == 0 || mp4info->moovOffset + mp4info->moovSize > (uint64_t)st.st_size) {
+        _E("no complete moov in %s \n", filePath.c_str());
+        ::close(fd);
+        delete mp4info;
+        return NULL;
+    }
+
+    // the mdat is normally right after a leading moov or right before the
+    // box where the tail probe took over; fetch just those headers so the
+    // window keeps holding the moov
+    while (mp4info->mdatSize == 0 && position + ATOM_PREAMBLE_SIZE <= st.st_size) {
+        unsigned char atom_bytes[ATOM_PREAMBLE_SIZE * 2];
+        ssize_t r = pread(fd, atom_bytes, sizeof(atom_bytes), position);
+        if (r < ATOM_PREAMBLE_SIZE) {
+            break;
+        }
+        uint64_t atom_size = (uint32_t) BE_32(&atom_bytes[0]);
+        int32_t header_size = ATOM_PREAMBLE_SIZE;
+        if (atom_size == 1 && r == sizeof(atom_bytes)) {
+            atom_size = BE_64(&atom_bytes[8]);
+            header_size += 8;
+        }
+        else if (atom_size == 0) {
+            atom_size = st.st_size - position;
+        }
+        if (atom_size < ATOM_PREAMBLE_SIZE) {
+            break;
+        }
+        if ((uint32_t) BE_32(&atom_bytes[4]) == MDAT_ATOM) {
+            mp4info->mdatOffset = position;
+            mp4info->mdatSize = atom_size;
+            mp4info->mdatHeaderSize = header_size;
+        }
+        position += atom_size;
+    }
+
+    const uint8_t *moov = wf.get(mp4info->moovOffset, ATOM_PREAMBLE_SIZE * 2);
+    off_t moovHeaderSize = (moov != NULL && BE_32(moov) == 1) ? ATOM_PREAMBLE_SIZE * 2 : ATOM_PREAMBLE_SIZE;
+
+    TrackInfo *ti = NULL;
+    bool ok = moov != NULL && ParseLazyBoxes(wf,
+                mp4info->moovOffset + moovHeaderSize,
+                mp4info->moovOffset + mp4info->moovSize,
+                mp4info, ti);
+    ::close(fd);
+    _I("lazy parse of %s took %d reads \n", filePath.c_str(), wf.mReadCount);
+
+    if (!ok) {
+        _E("parse moov of %s failed \n", filePath.c_str());
+        DeleteMP4Info(mp4info);
+        return NULL;
+    }
+
+    return mp4info;
+}
+
+// stco[].firstSampleIndex (0-based) from the stsc runs
+static void
+MapChunkFirstSamples(TrackInfo *ti)
+{
+    int32_t chunkCount = ti->stco.size();
+    int32_t c = 0;
+    int32_t i = 0;
+    for (vector<stscEntry>::iterator it = ti->stsc.begin(); it != ti->stsc.end(); ++it) {
+        int32_t cc = chunkCount;
+        if (it + 1 != ti->stsc.end()) {
+            cc = min((it + 1)->firstChunkIndex - 1, chunkCount);
+        }
+        while (c < cc) {
+            ti->stco[c++].firstSampleIndex = i;
+            i += it->samplesPerChunk;
+        }
+    }
+}
+
+int
+LoadTrackTables(MP4Info *mp4info, TrackInfo *ti)
+{
+    if (ti == NULL) {
+        return -1;
+    }
+    if (!ti->mTablesDeferred) {
+        return 0;
+    }
+
+    int fd = ::open(mp4info->mFilePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        _E("open %s failed \n", mp4info->mFilePath.c_str());
+        return -1;
+    }
+
+    vector<uint8_t> tables(ti->mTablesSize);
+    ssize_t r = tables.empty() ? 0 : pread(fd, &tables[0], tables.size(), ti->mTablesOffset);
+    ::close(fd);
+    if (r < 0 || (uint64_t)r != tables.size()) {
+        _E("read sample tables of track %d failed \n", ti->trackID);
+        return -2;
+    }
+
+    BoxReader reader(tables.empty() ? NULL : &tables[0], tables.size());
+    if (!ParseMappedBoxes(reader, mp4info, ti)) {
+        _E("parse sample tables of track %d failed \n", ti->trackID);
+        return -3;
+    }
+    MapChunkFirstSamples(ti);
+
+    ti->mTablesDeferred = false;
+    return 0;
+}
+
+void
+ReleaseTrackTables(TrackInfo *ti)
+{
+    vector<sttsEntry>().swap(ti->stts);
+    vector<cttsEntry>().swap(ti->ctts);
+    vector<int32_t>().swap(ti->stss);
+    vector<int32_t>().swap(ti->stsz);
+    vector<stscEntry>().swap(ti->stsc);
+    vector<stcoEntry>().swap(ti->stco);
+
+    // tables that came from a lazy parse can be loaded again
+    ti->mTablesDeferred = ti->mTablesSize != 0;
+}
+
+MP4Info*
+ExtractMP4Info(string filePath, ExtractMode mode)
+{
+    MP4Info *mp4info = LoadMP4IndexCache(filePath);
+    if (mp4info != NULL) {
+        return mp4info;
+    }
+
+    if (mode == EXTRACT_MODE_MAPPED) {
+        mp4info = ExtractMP4InfoMapped(filePath);
+    }
+    else if (mode == EXTRACT_MODE_LAZY) {
+        mp4info = ExtractMP4InfoLazy(filePath);
+    }
+    else {
+        mp4info = ExtractMP4InfoStream(filePath);
+    }
+
+    if (mp4info != NULL && mode != EXTRACT_MODE_LAZY) {
+        if (mp4info->mVideoTrackInfo != NULL) {
+            MapChunkFirstSamples(mp4info->mVideoTrackInfo);
+        }
+        if (mp4info->mAudioTrackInfo != NULL) {
+            MapChunkFirstSamples(mp4info->mAudioTrackInfo);
+        }
+        StoreMP4IndexCache(mp4info);
+    }
+    return mp4info;
+}
+
+/*
+ * The last key frame at or before the 1-based sample id, the first one if
+ * there is none, as a track need not start on one; without stss every
+ * sample is one.
+ */
+static int32_t
+KeyFrameAtOrBefore(const TrackInfo *ti, int32_t id)
+{
+    if (ti->stss.empty()) {
+        return id;
+    }
+    vector<int32_t>::const_iterator it = upper_bound(ti->stss.begin(), ti->stss.end(), id);
+    return it == ti->stss.begin() ? ti->stss.front() : *--it;
+}
+
+// write the trim to destFD if there is one, dest otherwise, or only lay
+// it out when layout is given
+static int
+PerformTrim(MP4Info *mp4info, const char* dest, int destFD, const MP4WriteOptions *options, MP4Layout *layout)
+{
+    MP4Rewriter progressiveWriter;
+    MP4FragmentRewriter fragmentWriter;
+    MP4Rewriter& writer = (options != NULL && options->fragmentDurationMs > 0) ? fragmentWriter : progressiveWriter;
+    if (destFD >= 0) {
+        if (writer.setOutputFD(destFD) != 0) {
+            return -1;
+        }
+    }
+    else {
+        writer.setOutputPath(dest);
+    }
+    if (options != NULL) {
+        writer.setOptions(*options);
+    }
+    if (layout != NULL) {
+        return writer.plan(mp4info, layout);
+    }
+    if (writer.open() != 0) {
+        return -1;
+    }
+    int ret = writer.write(mp4info);
+    if (writer.close() != 0 && ret == 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Checks and the fake end chunks every trim of mp4info resolves against;
+ * once per parse, however many ranges are cut from it.
+ */
+static int
+PrepareTrim(MP4Info *mp4info)
+{
+    if (mp4info->mVideoTrackInfo->stsc.empty()) {
+        _E("video track has no stsc info!\n");
+        return -9527;
+    }
+    if (mp4info->mAudioTrackInfo->stsc.empty()) {
+        _E("audio track has no stsc info!\n");
+        return -9528;
+    }
+
+    // the first sample of every real chunk is mapped at extraction time,
+    // the fake video chunk starts right after the last sample
+    stcoEntry fakeStcoEntry;
+    fakeStcoEntry.firstSampleIndex = -1;
+    fakeStcoEntry.chunkOffset = mp4info->mdatOffset + mp4info->mdatSize;
+    _I("fake stco entry with size %lld\n", (long long)fakeStcoEntry.chunkOffset);
+    mp4info->mAudioTrackInfo->stco.push_back(fakeStcoEntry);
+    {
+        TrackInfo *vi = mp4info->mVideoTrackInfo;
+        fakeStcoEntry.firstSampleIndex = 0;
+        if (!vi->stco.empty()) {
+            vector<stscEntry>::iterator run = upper_bound(vi->stsc.begin(), vi->stsc.end(),
+                                        (int32_t)vi->stco.size(), compareStscChunkIndex);
+            fakeStcoEntry.firstSampleIndex = vi->stco.back().firstSampleIndex + (run - 1)->samplesPerChunk;
+        }
+        vi->stco.push_back(fakeStcoEntry);
+    }
+
+    _I("video stco -- %ld \n", mp4info->mVideoTrackInfo->stco.size());
+    _I("audio stco -- %ld \n", mp4info->mAudioTrackInfo->stco.size());
+
+    return 0;
+}
+
+// of the 0-based sample, walking the stts runs
+static uint64_t
+DecodeTime(const vector<sttsEntry>& stts, int32_t sample)
+{
+    uint64_t time = 0;
+    for (vector<sttsEntry>::const_iterator it = stts.begin(); it != stts.end() && sample > 0; ++it) {
+        int32_t count = min(it->count, sample);
+        time += (uint64_t)count * it->delta;
+        sample -= count;
+    }
+    return time;
+}
+
+// ctts offset of the 0-based sample, 0 without ctts
+static int32_t
+CompositionOffset(const vector<cttsEntry>& ctts, int32_t sample)
+{
+    for (vector<cttsEntry>::const_iterator it = ctts.begin(); it != ctts.end(); ++it) {
+        if (sample < it->count) {
+            return it->delta;
+        }
+        sample -= it->count;
+    }
+    return 0;
+}
+
+// first audio sample of the chunk, all of them for the fake end chunk
+static uint32_t
+AudioSampleOfChunk(MP4Info *mp4info, stcoVectorIterator chunk)
+{
+    TrackInfo *ti = mp4info->mAudioTrackInfo;
+    return chunk + 1 == ti->stco.end() ? ti->stsz.size() : chunk->firstSampleIndex;
+}
+
+/*
+ * Composition time of the 0-based video sample in [first, cease) that is
+ * presented first at or after time; B-frames put samples out of decode
+ * order, so the search runs on until the decode time passes the best one
+ * found. The composition time of first when there is none.
+ */
+static uint64_t
+FirstCompositionAtOrAfter(const vector<cttsEntry>& ctts, const SampleTimeIndex& videoTimes, int32_t first, int32_t cease, uint64_t time)
+{
+    vector<cttsEntry>::const_iterator run = ctts.begin();
+    int32_t skip = first;
+    while (run != ctts.end() && skip >= run->count) {
+        skip -= run->count;
+        ++run;
+    }
+
+    int64_t best = -1;
+    for (int32_t i = first; i < cease; ++i) {
+        int64_t decode = videoTimes.sampleTime(i);
+        if (best >= 0 && decode > best) {
+            break;
+        }
+        int64_t composition = decode + (run != ctts.end() ? run->delta : 0);
+        if (composition >= (int64_t)time && (best < 0 || composition < best)) {
+            best = composition;
+        }
+        if (run != ctts.end() && ++skip == run->count) {
+            skip = 0;
+            ++run;
+        }
+    }
+    if (best < 0) {
+        best = videoTimes.sampleTime(first) + CompositionOffset(ctts, first);
+    }
+    return best;
+}
+
+/*
+ * Set the trim fields of mp4info from the 1-based video sample
+ * beginVideoID up to, not including, ceaseVideoID. The audio goes with
+ * the chunks that sit between the two in the file.
+ */
+static void
+ResolveTrimSamples(MP4Info *mp4info, const SampleTimeIndex& videoTimes, int32_t beginVideoID, int32_t ceaseVideoID)
+{
+    TrackInfo* videoInfo = mp4info->mVideoTrackInfo;
+
+    mp4info->trimBeginVideoID = beginVideoID;
+    mp4info->trimCeaseVideoID = ceaseVideoID;
+
+    // TODO HEERE
+
+    stcoVectorIterator cb = upper_bound(
+                mp4info->mVideoTrackInfo->stco.begin(),
+                mp4info->mVideoTrackInfo->stco.end(),
+                mp4info->trimBeginVideoID - 1,
+                compareStcoSampleIndex);
+    --cb;
+    stcoVectorIterator ce = upper_bound(
+                mp4info->mVideoTrackInfo->stco.begin(),
+                mp4info->mVideoTrackInfo->stco.end(),
+                mp4info->trimCeaseVideoID - 1,
+                compareStcoSampleIndex);
+    --ce;
+
+    mp4info->trimBeginVideoChunk = cb;
+    mp4info->trimCeaseVideoChunk = ce;
+
+    _I("cb: %d, %d, %lld \n", mp4info->trimBeginVideoID, cb->firstSampleIndex, (long long)cb->chunkOffset);
+    _I("ce: %d, %d, %lld \n", mp4info->trimCeaseVideoID, ce->firstSampleIndex, (long long)ce->chunkOffset);
+
+    mp4info->trimBeginOffset = cb->chunkOffset;
+    for (auto i = cb->firstSampleIndex; i < mp4info->trimBeginVideoID - 1; ++i) {
+        mp4info->trimBeginOffset += mp4info->mVideoTrackInfo->stsz[i];
+    }
+
+    mp4info->trimCeaseOffset = ce->chunkOffset;
+    for (auto i = ce->firstSampleIndex; i < mp4info->trimCeaseVideoID - 1; ++i) {
+        mp4info->trimCeaseOffset += mp4info->mVideoTrackInfo->stsz[i];
+    }
+
+    _I("media data: %lld --> %lld \n", (long long)mp4info->trimBeginOffset, (long long)mp4info->trimCeaseOffset);
+
+    uint64_t timestampDelta = videoTimes.sampleTime(mp4info->trimCeaseVideoID - 1) - videoTimes.sampleTime(mp4info->trimBeginVideoID - 1);
+    mp4info->postTrimDurationUs = timestampDelta * 1000000 / videoInfo->timeScale;
+    mp4info->postTrimDuration = (mp4info->postTrimDurationUs * mp4info->timeScale + 5E5) / 1E6;
+
+
+    // audio stuffs
+    stcoVectorIterator ab = upper_bound(
+                mp4info->mAudioTrackInfo->stco.begin(),
+                mp4info->mAudioTrackInfo->stco.end(),
+                mp4info->trimBeginOffset,
+                compareStcoOffset);
+    stcoVectorIterator ac = upper_bound(
+                mp4info->mAudioTrackInfo->stco.begin(),
+                mp4info->mAudioTrackInfo->stco.end(),
+                mp4info->trimCeaseOffset,
+                compareStcoOffset);
+
+    // a range running past the last audio chunk ends on the fake one,
+    // which sits right at the end of the mdat
+    if (ab == mp4info->mAudioTrackInfo->stco.end()) {
+        --ab;
+    }
+    if (ac == mp4info->mAudioTrackInfo->stco.end()) {
+        --ac;
+    }
+    mp4info->trimBeginAudioChunk = ab;
+    mp4info->trimCeaseAudioChunk = ac;
+
+    mp4info->trimBeginAudioID = AudioSampleOfChunk(mp4info, ab) + 1;
+    mp4info->trimCeaseAudioID = AudioSampleOfChunk(mp4info, ac) + 1;
+
+    _I("audio begin: [%u] %lld \n", mp4info->trimBeginAudioID, (long long)ab->chunkOffset);
+    _I("audio cease: [%u] %lld \n", mp4info->trimCeaseAudioID, (long long)ac->chunkOffset);
+
+    // the audio goes by chunks, so it starts near the video but not on it
+    TrackInfo* audioInfo = mp4info->mAudioTrackInfo;
+    uint64_t videoBegin = videoTimes.sampleTime(mp4info->trimBeginVideoID - 1);
+    mp4info->trimVideoLeadIn = 0;
+    mp4info->trimAudioLeadIn = (int64_t)(videoBegin * audioInfo->timeScale / videoInfo->timeScale)
+                             - (int64_t)DecodeTime(audioInfo->stts, mp4info->trimBeginAudioID - 1);
+}
+
+/*
+ * Set the trim fields of mp4info to the range [beginMs, ceaseMs), a
+ * ceaseMs of -1 running to the end.
+ */
+static void
+ResolveTrim(MP4Info *mp4info, const SampleTimeIndex& videoTimes, int beginMs, int ceaseMs)
+{
+    TrackInfo* videoInfo = mp4info->mVideoTrackInfo;
+    int32_t sampleCount = videoTimes.sampleCount();
+
+    _I("time scale: %d \n", videoInfo->timeScale);
+
+
+    // IDs are 1-based, sampleCount + 1 standing for the end of the track
+
+    // begin = beginMs / 1000 * 90000
+    uint64_t begin = beginMs * (videoInfo->timeScale / 1000);
+    mp4info->trimBeginID0 = videoTimes.firstSampleAtOrAfter(begin) + 1;
+    _I("begin: %d|%llu -- %d -- %llu\n", beginMs, (unsigned long long)begin, mp4info->trimBeginID0, (unsigned long long)videoTimes.sampleTime(mp4info->trimBeginID0 - 1));
+
+
+    // cease = ceaseMs / 1000 * 90000
+    if (ceaseMs != -1) {
+        uint64_t cease = ceaseMs * (videoInfo->timeScale / 1000);
+        mp4info->trimCeaseID0 = videoTimes.firstSampleAtOrAfter(cease) + 1;
+        _I("cease: %d|%llu -- %d -- %llu\n", ceaseMs, (unsigned long long)cease, mp4info->trimCeaseID0, (unsigned long long)videoTimes.sampleTime(mp4info->trimCeaseID0 - 1));
+    }
+    else {
+        mp4info->trimCeaseID0 = -1;
+    }
 
-    // audio stuffs
-    stcoVectorIterator ab = upper_bound(
-                mp4info->mAudioTrackInfo->stco.begin(),
-                mp4info->mAudioTrackInfo->stco.end(),
-                mp4info->trimBeginOffset,
-                compareStcoOffset);
-    stcoVectorIterator ac = upper_bound(
-                mp4info->mAudioTrackInfo->stco.begin(),
-                mp4info->mAudioTrackInfo->stco.end(),
-                mp4info->trimCeaseOffset,
-                compareStcoOffset);
 
-    mp4info->trimBeginAudioChunk = ab;
-    mp4info->trimCeaseAudioChunk = ac;
+    // the trim starts on the key frame at or before the begin, or on the
+    // first one, which may leave nothing before the cease
+    int32_t beginID = KeyFrameAtOrBefore(videoInfo, mp4info->trimBeginID0);
+    int32_t ceaseID = mp4info->trimCeaseID0 != -1 ? mp4info->trimCeaseID0 : sampleCount;
+    ResolveTrimSamples(mp4info, videoTimes, beginID, max(beginID, ceaseID));
+
+    // and is presented, where there is an edit list, from the composition
+    // time of the first sample shown at or after the begin: B-frames put it
+    // off its decode time, and a key frame right on the begin by its ctts
+    uint64_t videoBegin = videoTimes.sampleTime(mp4info->trimBeginVideoID - 1);
+    uint64_t composition = FirstCompositionAtOrAfter(videoInfo->ctts, videoTimes, mp4info->trimBeginVideoID - 1,
+                                                     mp4info->trimCeaseVideoID - 1, begin);
+    mp4info->trimVideoLeadIn = (int64_t)(composition - videoBegin);
+    mp4info->trimAudioLeadIn += mp4info->trimVideoLeadIn * mp4info->mAudioTrackInfo->timeScale / videoInfo->timeScale;
+    _I("lead-in: video %lld, audio %lld \n", (long long)mp4info->trimVideoLeadIn, (long long)mp4info->trimAudioLeadIn);
+}
+
+static int
+TrimFile(const char* src, const char* dest, int destFD, int beginMs, int ceaseMs, const MP4WriteOptions *options, MP4Layout *layout)
+{
+    if (beginMs < 0) {
+        beginMs = 0;
+    }
+
+    if (ceaseMs < 0) {
+        ceaseMs = -1;
+    }
+
+    MP4Info *mp4info = ExtractMP4Info(src);
+    if (mp4info == NULL) {
+        _E("extract mp4 info from %s failed!\n", src);
+        return -1;
+    }
+    _I("mp4 duration: %dms, GOPs:%lu \n", mp4info->duration, mp4info->mVideoTrackInfo->stss.size());
 
-    mp4info->trimBeginAudioID = ab->firstSampleIndex + 1;
-    mp4info->trimCeaseAudioID = ac->firstSampleIndex + 1;
+    int ret = PrepareTrim(mp4info);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // decode times stay as stts runs, each trim point is a binary search
+    SampleTimeIndex videoTimes;
+    videoTimes.build(mp4info->mVideoTrackInfo->stts);
+    _I("video samples: %u, time index: %zu bytes \n", videoTimes.sampleCount(), videoTimes.memoryFootprint());
 
-    _I("audio begin: [%u] %d \n", mp4info->trimBeginAudioID, ab->chunkOffset);
-    _I("audio cease: [%u] %d \n", mp4info->trimCeaseAudioID, ac->chunkOffset);
+    ResolveTrim(mp4info, videoTimes, beginMs, ceaseMs);
 
     // trim
-    PerformTrim(mp4info, dest);
+    return PerformTrim(mp4info, dest, destFD, options, layout);
+}
+
+int mp4trim(const char* src, const char* dest, int beginMs, int ceaseMs, const MP4WriteOptions *options)
+{
+    return TrimFile(src, dest, -1, beginMs, ceaseMs, options, NULL);
+}
+
+int mp4trimfd(const char* src, int destFD, int beginMs, int ceaseMs, const MP4WriteOptions *options)
+{
+    return TrimFile(src, NULL, destFD, beginMs, ceaseMs, options, NULL);
+}
+
+int mp4trimlayout(const char* src, const char* dest, int beginMs, int ceaseMs, const MP4WriteOptions *options, MP4Layout *layout)
+{
+    return TrimFile(src, dest, -1, beginMs, ceaseMs, options, layout);
+}
+
+static bool
+compareTrimRangeBegin(const MP4TrimRange *a, const MP4TrimRange *b)
+{
+    return a->beginMs < b->beginMs;
+}
+
+/*
+ * Ranges are written in the order they start, so ranges that share
+ * media data copy it while the first one has just brought it into the
+ * page cache.
+ */
+int mp4trimbatch(const char* src, std::vector<MP4TrimRange>& ranges, const MP4WriteOptions *options)
+{
+    for (vector<MP4TrimRange>::iterator it = ranges.begin(); it != ranges.end(); ++it) {
+        it->result = -1;
+    }
+
+    MP4Info *mp4info = ExtractMP4Info(src);
+    if (mp4info == NULL) {
+        _E("extract mp4 info from %s failed!\n", src);
+        return -1;
+    }
+
+    int ret = PrepareTrim(mp4info);
+    if (ret != 0) {
+        return ret;
+    }
+
+    SampleTimeIndex videoTimes;
+    videoTimes.build(mp4info->mVideoTrackInfo->stts);
+
+    vector<MP4TrimRange*> order;
+    for (vector<MP4TrimRange>::iterator it = ranges.begin(); it != ranges.end(); ++it) {
+        order.push_back(&*it);
+    }
+    stable_sort(order.begin(), order.end(), compareTrimRangeBegin);
+
+    for (vector<MP4TrimRange*>::iterator it = order.begin(); it != order.end(); ++it) {
+        MP4TrimRange *range = *it;
+        ResolveTrim(mp4info, videoTimes, max(range->beginMs, 0), range->ceaseMs < 0 ? -1 : range->ceaseMs);
+        range->result = PerformTrim(mp4info, range->dest.c_str(), -1, options, NULL);
+        if (range->result != 0) {
+            _E("trim %d - %d of %s to %s failed \n", range->beginMs, range->ceaseMs, src, range->dest.c_str());
+            if (ret == 0) {
+                ret = range->result;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Everything before the trim cease is already in place, so the cost is
+ * that of the moov, whatever the size of the file.
+ */
+int mp4trimtail(const char* path, int ceaseMs, const MP4WriteOptions *options)
+{
+    MP4Info *mp4info = ExtractMP4Info(path);
+    if (mp4info == NULL) {
+        _E("extract mp4 info from %s failed!\n", path);
+        return -1;
+    }
+
+    int ret = PrepareTrim(mp4info);
+    if (ret != 0) {
+        return ret;
+    }
+
+    TrackInfo *videoInfo = mp4info->mVideoTrackInfo;
+    SampleTimeIndex videoTimes;
+    videoTimes.build(videoInfo->stts);
+    if (ceaseMs < 0 || videoTimes.firstSampleAtOrAfter(ceaseMs * (videoInfo->timeScale / 1000)) >= videoTimes.sampleCount()) {
+        _I("%s ends before %dms, nothing to trim \n", path, ceaseMs);
+        return 0;
+    }
+
+    ResolveTrim(mp4info, videoTimes, 0, ceaseMs);
+    if (mp4info->trimBeginVideoID != 1) {
+        _E("%s does not start on a key frame \n", path);
+        return -1;
+    }
+
+    // the audio stays from its first sample too, where it is interleaved
+    // ahead of the first video chunk as well
+    TrackInfo *audioInfo = mp4info->mAudioTrackInfo;
+    mp4info->trimBeginAudioChunk = audioInfo->stco.begin();
+    mp4info->trimBeginAudioID = 1;
+    mp4info->trimAudioLeadIn = 0;
+    mp4info->trimBeginOffset = min(mp4info->trimBeginOffset, (off_t)audioInfo->stco.front().chunkOffset);
+
+    int fd = ::open(path, O_RDWR);
+    if (fd < 0) {
+        _E("open %s for writing failed \n", path);
+        return -1;
+    }
+
+    MP4TailTrimRewriter writer;
+    if (writer.setOutputFD(fd) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    if (options != NULL) {
+        writer.setOptions(*options);
+    }
+    if (writer.open() != 0) {
+        ::close(fd);
+        return -1;
+    }
+    ret = writer.write(mp4info);
+    if (writer.close() != 0 && ret == 0) {
+        ret = -1;
+    }
+    ::close(fd);
+
+    return ret;
+}
+
+// seconds from 1904-01-01, where MP4 time starts, to the Unix epoch
+#define MPEG4_EPOCH_OFFSET ((int64_t)(66 * 365 + 17) * (24 * 60 * 60))
+
+struct MetadataWrite
+{
+    off_t offset;
+    uint32_t size;
+    uint8_t bytes[36];
+};
+
+static void
+AddMetadataWrite(vector<MetadataWrite>& writes, off_t offset, const uint32_t *values, int count)
+{
+    MetadataWrite w;
+    w.offset = offset;
+    w.size = count * 4;
+    for (int i = 0; i < count; i++) {
+        w.bytes[i * 4 + 0] = values[i] >> 24;
+        w.bytes[i * 4 + 1] = values[i] >> 16;
+        w.bytes[i * 4 + 2] = values[i] >> 8;
+        w.bytes[i * 4 + 3] = values[i];
+    }
+    writes.push_back(w);
+}
+
+/*
+ * The creation and modification time of the full box whose version byte
+ * is at offset; version 0 only holds 32 bits of them.
+ */
+static bool
+AddTimesWrite(vector<MetadataWrite>& writes, off_t offset, uint8_t version, const MP4MetadataPatch& patch)
+{
+    int64_t times[2] = { patch.creationTime, patch.modificationTime };
+    for (int i = 0; i < 2; i++) {
+        if (times[i] < 0) {
+            continue;
+        }
+        uint64_t t = times[i] + MPEG4_EPOCH_OFFSET;
+        if (version == 1) {
+            uint32_t values[2] = { (uint32_t)(t >> 32), (uint32_t)t };
+            AddMetadataWrite(writes, offset + 4 + i * 8, values, 2);
+        }
+        else if (t <= UINT32_MAX) {
+            uint32_t value = t;
+            AddMetadataWrite(writes, offset + 4 + i * 4, &value, 1);
+        }
+        else {
+            _E("time %lld does not fit a version 0 box \n", (long long)times[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Walk the boxes of r, a part of the moov at moovOffset that starts at
+ * moov, and note every write the patch takes. Inside a trak, handler is
+ * set from its hdlr and tkhd to where its tkhd is, for the caller to
+ * patch once the whole trak is known.
+ */
+static bool
+CollectMetadataWrites(BoxReader& r, const uint8_t *moov, off_t moovOffset, const MP4MetadataPatch& patch,
+        vector<MetadataWrite>& writes, uint32_t *handler, const uint8_t **tkhd)
+{
+    while (r.remain() >= ATOM_PREAMBLE_SIZE) {
+        const uint8_t *atom_bytes = r.take(ATOM_PREAMBLE_SIZE);
+        uint64_t atom_size = (uint32_t) BE_32(&atom_bytes[0]);
+        uint32_t atom_type = BE_32(&atom_bytes[4]);
+        uint64_t header_size = ATOM_PREAMBLE_SIZE;
+
+        if (atom_size == 1) {
+            atom_size = r.readInt64();
+            header_size += 8;
+        }
+        else if (atom_size == 0) {
+            atom_size = r.remain() + header_size;
+        }
+
+        if (r.mError || atom_size < header_size || atom_size - header_size > r.remain()) {
+            _E("malformed box %c%c%c%c \n", atom_bytes[4], atom_bytes[5], atom_bytes[6], atom_bytes[7]);
+            return false;
+        }
+
+        BoxReader box = r.sub(atom_size - header_size);
+        off_t offset = moovOffset + (box.mData - moov);
+
+        switch (atom_type)
+        {
+        case MOOV_ATOM:
+        case MDIA_ATOM:
+            if (!CollectMetadataWrites(box, moov, moovOffset, patch, writes, handler, tkhd)) {
+                return false;
+            }
+            break;
+
+        case TRAK_ATOM:
+        {
+            uint32_t trakHandler = 0;
+            const uint8_t *trakTkhd = NULL;
+            if (!CollectMetadataWrites(box, moov, moovOffset, patch, writes, &trakHandler, &trakTkhd)) {
+                return false;
+            }
+            if (trakTkhd == NULL) {
+                break;
+            }
+
+            BoxReader header(trakTkhd, box.mData + box.mSize - trakTkhd);
+            off_t tkhdOffset = moovOffset + (trakTkhd - moov);
+            uint32_t versionFlags = header.readInt32();
+            uint8_t version = versionFlags >> 24;
+            header.skip(version == 1 ? 32 : 20);        // times, trackID, reserved, duration
+            header.skip(16);                            // reserved, layer, alternate group, volume, reserved
+            header.skip(36);                            // matrix
+            if (header.mError) {
+                _E("tkhd too short \n");
+                return false;
+            }
 
-    return 0; 
+            int enabled = trakHandler == VIDE_FOURCC ? patch.videoEnabled :
+                          trakHandler == SOUN_FOURCC ? patch.audioEnabled : -1;
+            if (enabled >= 0) {
+                uint32_t value = enabled ? (versionFlags | 0x1) : (versionFlags & ~0x1);
+                AddMetadataWrite(writes, tkhdOffset, &value, 1);
+            }
+            if (!AddTimesWrite(writes, tkhdOffset, version, patch)) {
+                return false;
+            }
+            if (trakHandler == VIDE_FOURCC && patch.rotation >= 0) {
+                uint32_t matrix[9];
+                if (!MP4Rewriter::CompositionMatrix(patch.rotation, matrix)) {
+                    _E("unsupported rotation %d \n", patch.rotation);
+                    return false;
+                }
+                AddMetadataWrite(writes, tkhdOffset + 4 + (version == 1 ? 32 : 20) + 16, matrix, 9);
+            }
+            break;
+        }
+
+        case MVHD_ATOM:
+        case MDHD_ATOM:
+        {
+            uint8_t version = box.readInt8();
+            box.skip(version == 1 ? 19 : 11);           // flags, times, timescale
+            if (box.mError) {
+                _E("%c%c%c%c too short \n", atom_bytes[4], atom_bytes[5], atom_bytes[6], atom_bytes[7]);
+                return false;
+            }
+            if (!AddTimesWrite(writes, offset, version, patch)) {
+                return false;
+            }
+            break;
+        }
+
+        case TKHD_ATOM:
+            if (tkhd != NULL) {
+                *tkhd = box.mData;
+            }
+            break;
+
+        case HDLR_ATOM:
+            if (handler != NULL) {
+                box.skip(8);                            // _, component type
+                *handler = box.readInt32();
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return !r.mError;
+}
+
+/*
+ * The moov is read and checked in full before the first byte is written,
+ * so a file the patch does not fit is left as it was.
+ */
+int mp4patch(const char* path, const MP4MetadataPatch& patch)
+{
+    MP4Info *mp4info = ExtractMP4Info(path, EXTRACT_MODE_LAZY);
+    if (mp4info == NULL) {
+        _E("extract mp4 info from %s failed!\n", path);
+        return -1;
+    }
+
+    int fd = ::open(path, O_RDWR);
+    if (fd < 0) {
+        _E("open %s for writing failed \n", path);
+        DeleteMP4Info(mp4info);
+        return -1;
+    }
+
+    vector<uint8_t> moov(mp4info->moovSize);
+    if (pread(fd, &moov[0], moov.size(), mp4info->moovOffset) != (ssize_t)moov.size()) {
+        _E("read moov of %s failed \n", path);
+        ::close(fd);
+        DeleteMP4Info(mp4info);
+        return -1;
+    }
+
+    BoxReader reader(&moov[0], moov.size());
+    vector<MetadataWrite> writes;
+    if (!CollectMetadataWrites(reader, &moov[0], mp4info->moovOffset, patch, writes, NULL, NULL)) {
+        _E("parse moov of %s failed \n", path);
+        ::close(fd);
+        DeleteMP4Info(mp4info);
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < writes.size(); i++) {
+        if (pwrite(fd, writes[i].bytes, writes[i].size, writes[i].offset) != (ssize_t)writes[i].size) {
+            _E("patch %s at %lld failed \n", path, (long long)writes[i].offset);
+            ret = -1;
+            break;
+        }
+    }
+    ::close(fd);
+    DeleteMP4Info(mp4info);
+
+    return ret;
+}
+
+int mp4reel(const char* src, const char* dest, const std::vector<MP4Clip>& clips, const MP4WriteOptions *options)
+{
+    MP4Info *mp4info = ExtractMP4Info(src);
+    if (mp4info == NULL) {
+        _E("extract mp4 info from %s failed!\n", src);
+        return -1;
+    }
+
+    int ret = PrepareTrim(mp4info);
+    if (ret != 0) {
+        return ret;
+    }
+
+    TrackInfo *videoInfo = mp4info->mVideoTrackInfo;
+    SampleTimeIndex videoTimes;
+    videoTimes.build(videoInfo->stts);
+
+    ReelTask reelTask;
+    reelTask.mInfo = mp4info;
+    for (vector<MP4Clip>::const_iterator it = clips.begin(); it != clips.end(); ++it) {
+        // a cease past the last sample runs to the end
+        int ceaseMs = it->ceaseMs;
+        if (ceaseMs >= 0 && videoTimes.firstSampleAtOrAfter(ceaseMs * (videoInfo->timeScale / 1000)) >= videoTimes.sampleCount()) {
+            ceaseMs = -1;
+        }
+        ResolveTrim(mp4info, videoTimes, max(it->beginMs, 0), ceaseMs < 0 ? -1 : ceaseMs);
+        if (mp4info->trimCeaseVideoID <= mp4info->trimBeginVideoID) {
+            _W("clip %d - %d of %s is empty, skipped \n", it->beginMs, it->ceaseMs, src);
+            continue;
+        }
+
+        ReelClip clip;
+        clip.videoBegin = mp4info->trimBeginVideoID - 1;
+        clip.videoCease = mp4info->trimCeaseVideoID - 1;
+        clip.audioBegin = AudioSampleOfChunk(mp4info, mp4info->trimBeginAudioChunk);
+        clip.audioCease = AudioSampleOfChunk(mp4info, mp4info->trimCeaseAudioChunk);
+        clip.beginOffset = mp4info->trimBeginOffset;
+        clip.ceaseOffset = mp4info->trimCeaseOffset;
+        reelTask.mClips.push_back(clip);
+    }
+    if (reelTask.mClips.empty()) {
+        _E("no clip of %s to write \n", src);
+        return -1;
+    }
+
+    MP4ReelRewriter writer;
+    writer.setOutputPath(dest);
+    if (options != NULL) {
+        writer.setOptions(*options);
+    }
+    if (writer.open() != 0) {
+        return -1;
+    }
+    ret = writer.write(&reelTask);
+    if (writer.close() != 0 && ret == 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * A part pattern takes the part number through exactly one int conversion
+ * (flags, width and precision allowed, no length modifier); any other '%'
+ * has to be "%%". Anything else would hand snprintf() arguments it does
+ * not get.
+ */
+static bool
+IsPartPattern(const char* pattern)
+{
+    int conversions = 0;
+    for (const char *p = pattern; *p != '\0'; ++p) {
+        if (*p != '%') {
+            continue;
+        }
+        ++p;
+        if (*p == '%') {
+            continue;
+        }
+        while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+            ++p;
+        }
+        while (*p >= '0' && *p <= '9') {
+            ++p;
+        }
+        if (*p == '.') {
+            ++p;
+            while (*p >= '0' && *p <= '9') {
+                ++p;
+            }
+        }
+        if (*p == '\0' || strchr("diouxX", *p) == NULL) {
+            return false;
+        }
+        ++conversions;
+    }
+    return conversions == 1;
+}
+
+/*
+ * Parts run from key frame to key frame, so each one ends where the next
+ * begins in the mdat as well; written in order, the parts read the media
+ * data once, front to back.
+ */
+int mp4segment(const char* src, const char* destPattern, int segmentMs, const MP4WriteOptions *options)
+{
+    if (segmentMs <= 0) {
+        _E("bad segment duration %d \n", segmentMs);
+        return -1;
+    }
+    if (!IsPartPattern(destPattern)) {
+        _E("bad part pattern %s, it takes one int conversion \n", destPattern);
+        return -1;
+    }
+
+    MP4Info *mp4info = ExtractMP4Info(src);
+    if (mp4info == NULL) {
+        _E("extract mp4 info from %s failed!\n", src);
+        return -1;
+    }
+
+    int ret = PrepareTrim(mp4info);
+    if (ret != 0) {
+        return ret;
+    }
+
+    TrackInfo *videoInfo = mp4info->mVideoTrackInfo;
+    SampleTimeIndex videoTimes;
+    videoTimes.build(videoInfo->stts);
+
+    // sample IDs are 1-based; as with a trim to the end, the last part
+    // stops at the last sample
+    int32_t sampleCount = videoTimes.sampleCount();
+    vector<int32_t> keyFrames = videoInfo->stss;
+    if (keyFrames.empty()) {
+        for (int32_t id = 1; id <= sampleCount; ++id) {
+            keyFrames.push_back(id);
+        }
+    }
+    uint64_t step = max((uint64_t)segmentMs * videoInfo->timeScale / 1000, (uint64_t)1);
+    uint64_t endTime = videoTimes.sampleTime(sampleCount - 1);
+
+    int parts = 0;
+    vector<int32_t>::const_iterator key = keyFrames.begin();
+    while (key != keyFrames.end() && *key < sampleCount) {
+        int32_t begin = *key;
+        uint64_t target = videoTimes.sampleTime(begin - 1) + step;
+        while (key != keyFrames.end() && *key < sampleCount && videoTimes.sampleTime(*key - 1) < target) {
+            ++key;
+        }
+
+        // a tail under half a part goes with the last one
+        int32_t cease = sampleCount;
+        if (key != keyFrames.end() && *key < sampleCount && endTime - videoTimes.sampleTime(*key - 1) >= step / 2) {
+            cease = *key;
+        }
+        else {
+            key = keyFrames.end();
+        }
+
+        char dest[PATH_MAX];
+        if (snprintf(dest, sizeof(dest), destPattern, parts) >= (int)sizeof(dest)) {
+            _E("part %d path too long \n", parts);
+            return -1;
+        }
+
+        mp4info->trimBeginID0 = begin;
+        mp4info->trimCeaseID0 = cease;
+        ResolveTrimSamples(mp4info, videoTimes, begin, cease);
+        ret = PerformTrim(mp4info, dest, -1, options, NULL);
+        if (ret != 0) {
+            _E("part %d of %s, samples %d - %d, to %s failed \n", parts, src, begin, cease, dest);
+            return ret;
+        }
+        ++parts;
+    }
+
+    return parts;
 }
 
-int mp4cat(const list<string> & src, const string dest)
+static int
+CatFiles(const list<string> & src, const string dest, int destFD, const MP4WriteOptions *options, MP4Layout *layout)
 {
     if (find(src.begin(), src.end(), dest) != src.end()) {
         _E("Destination is one of the source!");
@@ -703,15 +2234,51 @@ int mp4cat(const list<string> & src, const string dest)
     CatTask catTask;
     for (list<string>::const_iterator it = src.begin(); it != src.end(); ++it) {
         MP4Info *mp4info = ExtractMP4Info(*it);
+        if (mp4info == NULL) {
+            _E("extract mp4 info from %s failed!\n", it->c_str());
+            return -1;
+        }
         catTask.mInfoList.push_back(mp4info);
     }
 
     MP4CatRewriter writer;
-    writer.setOutputPath(dest);
-    writer.open();
-    writer.write(&catTask);
-    writer.close();
+    if (destFD >= 0) {
+        if (writer.setOutputFD(destFD) != 0) {
+            return -1;
+        }
+    }
+    else {
+        writer.setOutputPath(dest);
+    }
+    if (options != NULL) {
+        writer.setOptions(*options);
+    }
+    if (layout != NULL) {
+        return writer.plan(&catTask, layout);
+    }
+    if (writer.open() != 0) {
+        return -1;
+    }
+    int ret = writer.write(&catTask);
+    if (writer.close() != 0 && ret == 0) {
+        ret = -1;
+    }
 
-    return 0;
+    return ret;
+}
+
+int mp4cat(const list<string> & src, const string dest, const MP4WriteOptions *options)
+{
+    return CatFiles(src, dest, -1, options, NULL);
+}
+
+int mp4catfd(const list<string> & src, int destFD, const MP4WriteOptions *options)
+{
+    return CatFiles(src, string(), destFD, options, NULL);
+}
+
+int mp4catlayout(const list<string> & src, const string dest, const MP4WriteOptions *options, MP4Layout *layout)
+{
+    return CatFiles(src, dest, -1, options, layout);
 }
 
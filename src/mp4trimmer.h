@@ -35,7 +35,7 @@ inline bool compareStscChunkIndex(int32_t chunkIndex, const stscEntry& entry)
 struct stcoEntry
 {
     int32_t firstSampleIndex;
-    int32_t chunkOffset;
+    int64_t chunkOffset;
 };
 
 typedef std::vector<stcoEntry> stcoVector;
@@ -46,18 +46,11 @@ inline bool compareStcoSampleIndex(int32_t sampleIndex, const stcoEntry& entry)
     return sampleIndex < entry.firstSampleIndex;
 }
 
-inline bool compareStcoOffset(int32_t chunkOffset, const stcoEntry& entry)
+inline bool compareStcoOffset(int64_t chunkOffset, const stcoEntry& entry)
 {
     return chunkOffset < entry.chunkOffset;
 }
 
-struct TimeTableEntry
-{
-    uint32_t mID;
-    uint64_t mTimestamp;
-    bool mIsKeyFrame;
-};
-
 struct TrackInfo
 {
     bool mIsVideo;
@@ -85,7 +78,11 @@ struct TrackInfo
     std::vector<stscEntry> stsc; // sample count per chunk
     std::vector<stcoEntry> stco; // chunk offset
 
-    std::vector<TimeTableEntry> mTimeTable;
+    // EXTRACT_MODE_LAZY leaves the tables above empty and only records
+    // where they are; LoadTrackTables() decodes them on first use
+    bool mTablesDeferred;
+    off_t mTablesOffset;
+    uint64_t mTablesSize;
 };
 
 struct MP4Info
@@ -94,6 +91,7 @@ struct MP4Info
 
     long mdatOffset;
     uint64_t mdatSize;
+    int32_t mdatHeaderSize; // 8, or 16 for a 64-bit mdat
 
     long moovOffset;
     uint64_t moovSize;
@@ -129,10 +127,16 @@ struct MP4Info
     int64_t postTrimDurationUs;
     int32_t postTrimDuration;
 
-    int32_t postTrimMediaDataOffset;
+    // media time each track is presented from, in the track timescale:
+    // for video the composition time of the first sample presented at or
+    // after the trim begin; negative when the audio starts after it
+    int64_t trimVideoLeadIn;
+    int64_t trimAudioLeadIn;
 
-    int32_t postTrimFirstVideoOffset;
-    int32_t postTrimFirstAudioOffset;
+    int64_t postTrimMediaDataOffset;
+
+    int64_t postTrimFirstVideoOffset;
+    int64_t postTrimFirstAudioOffset;
 };
 
 struct TrimTask
@@ -146,10 +150,167 @@ struct CatTask
     std::list<MP4Info*> mInfoList;
 };
 
-MP4Info* ExtractMP4Info(std::string filePath);
+// one range of a reel, resolved as a trim would be; samples are 0-based
+// and the cease ones not included
+struct ReelClip
+{
+    uint32_t videoBegin;
+    uint32_t videoCease;
+    uint32_t audioBegin;
+    uint32_t audioCease;
+
+    // the source bytes holding those samples
+    off_t beginOffset;
+    off_t ceaseOffset;
+};
+
+struct ReelTask
+{
+    MP4Info *mInfo;
+    std::vector<ReelClip> mClips;
+};
+
+enum ExtractMode
+{
+    EXTRACT_MODE_STREAM,    // fread() every field off a FILE*
+    EXTRACT_MODE_MAPPED,    // mmap() the moov and walk it in memory
+    EXTRACT_MODE_LAZY,      // read only the moov headers, defer sample tables
+};
+
+MP4Info* ExtractMP4Info(std::string filePath, ExtractMode mode = EXTRACT_MODE_MAPPED);
+int LoadTrackTables(MP4Info *mp4info, TrackInfo *ti);
+void ReleaseTrackTables(TrackInfo *ti);
+
+struct MP4WriteOptions
+{
+    // lay out the media data on the same block offsets as in the source and
+    // clone it with FICLONERANGE, copying only what the filesystem refuses
+    bool reflink;
+
+    // ftyp, moov, mdat instead of ftyp, mdat, moov, so playback can start
+    // without the file tail
+    bool faststart;
+
+    // copy the media data with this many threads, each straight to its
+    // final offset; 1 copies sequentially. Ignored with reflink.
+    int copyThreads;
+    // most media data bytes those threads copy at once, 0 for no cap
+    int64_t copyInFlightBytes;
+
+    // copy the media data from one thread keeping this many reads and
+    // writes queued on an io_uring; the threads above copy instead where
+    // there is no io_uring. Ignored with reflink.
+    bool ioUring;
+    int ioUringQueueDepth;
+
+    // copy the media data sequentially in steps that are written back and
+    // dropped from the page cache as they go, so one-shot media data does
+    // not push out other processes' pages or pile up dirty ones. Overrides
+    // copyThreads and ioUring, ignored with reflink.
+    bool pacedCopy;
+
+    // write a trim as fragmented MP4, cut at the first video key frame at
+    // least this many ms into each fragment; 0 writes one moov and mdat
+    int fragmentDurationMs;
+
+    // reserve the whole output with fallocate() before writing; a volume
+    // without room fails the write up front
+    bool preallocate;
+
+    // present a trim from beginMs itself instead of the key frame before
+    // it: the samples from that key frame on are still written so they
+    // decode, and an edit list on each track skips them on playback
+    bool editList;
+
+    MP4WriteOptions() : reflink(false), faststart(false), copyThreads(1), copyInFlightBytes(64 << 20), ioUring(false), ioUringQueueDepth(64), pacedCopy(false), fragmentDurationMs(0), preallocate(false), editList(false) {}
+};
+
+// where a write puts its boxes, in bytes from the start of the output; for
+// fragmented output the mdat fields span all the fragments
+struct MP4Layout
+{
+    int64_t ftypOffset;
+    int64_t ftypSize;
+    int64_t moovOffset;
+    int64_t moovSize;
+    int64_t freeOffset;         // padding in front of the mdat
+    int64_t freeSize;           // 0 for none
+    int64_t mdatOffset;
+    int64_t mdatSize;           // header included
+    int64_t mediaDataOffset;    // of the first media byte
+    int64_t totalSize;
+
+    MP4Layout() : ftypOffset(0), ftypSize(0), moovOffset(0), moovSize(0), freeOffset(0), freeSize(0), mdatOffset(0), mdatSize(0), mediaDataOffset(0), totalSize(0) {}
+};
+
+int mp4trim(const char* src, const char* dest, int beginMs, int ceaseMs, const MP4WriteOptions *options = NULL);
+int mp4cat(const std::list<std::string> & src, const std::string dest, const MP4WriteOptions *options = NULL);
+
+struct MP4TrimRange
+{
+    int beginMs;
+    int ceaseMs;
+    std::string dest;
+
+    int result; // of this range, as mp4trim() would return it
+};
+
+// every range of src to its own dest, with src parsed and indexed once;
+// 0, or the result of the first range that failed
+int mp4trimbatch(const char* src, std::vector<MP4TrimRange>& ranges, const MP4WriteOptions *options = NULL);
+
+// cut path itself short at ceaseMs, keeping it from the start; only the
+// moov is rewritten and the file truncated, the media data stays put
+int mp4trimtail(const char* path, int ceaseMs, const MP4WriteOptions *options = NULL);
+
+// header fields mp4patch() overwrites; -1 leaves a field as it is
+struct MP4MetadataPatch
+{
+    // clockwise display rotation of every video track: 0, 90, 180 or 270
+    int rotation;
+
+    // Unix seconds, set on mvhd and every tkhd and mdhd
+    int64_t creationTime;
+    int64_t modificationTime;
+
+    // 0 or 1, the enabled flag of every video or audio tkhd
+    int videoEnabled;
+    int audioEnabled;
+
+    MP4MetadataPatch() : rotation(-1), creationTime(-1), modificationTime(-1), videoEnabled(-1), audioEnabled(-1) {}
+};
+
+// overwrite those fields of path in place; the boxes keep their sizes, so
+// nothing but the few patched bytes of the moov is written
+int mp4patch(const char* path, const MP4MetadataPatch& patch);
+
+struct MP4Clip
+{
+    int beginMs;
+    int ceaseMs;
+};
 
-int mp4trim(const char* src, const char* dest, int beginMs, int ceaseMs);
-int mp4cat(const std::list<std::string> & src, const std::string dest);
+// the clips of src played one after the other from a single dest, each
+// cut as mp4trim() would cut it; src is parsed once, and read once front
+// to back when the clips are in order and do not overlap
+int mp4reel(const char* src, const char* dest, const std::vector<MP4Clip>& clips, const MP4WriteOptions *options = NULL);
+
+// split src into consecutive parts of about segmentMs each, every one
+// starting on a video key frame; destPattern takes the 0-based part
+// number as printf would, e.g. "part%03d.mp4", through exactly one int
+// conversion and no other but "%%". The number of parts written, or what
+// the failing one returned.
+int mp4segment(const char* src, const char* destPattern, int segmentMs, const MP4WriteOptions *options = NULL);
+
+// write to an open fd, which stays open; on a pipe or socket the output
+// goes strictly front to back with the moov first. A regular file has to
+// be positioned at its start and not opened O_APPEND, or -1.
+int mp4trimfd(const char* src, int destFD, int beginMs, int ceaseMs, const MP4WriteOptions *options = NULL);
+int mp4catfd(const std::list<std::string> & src, int destFD, const MP4WriteOptions *options = NULL);
+
+// what mp4trim()/mp4cat() would write, from the metadata alone
+int mp4trimlayout(const char* src, const char* dest, int beginMs, int ceaseMs, const MP4WriteOptions *options, MP4Layout *layout);
+int mp4catlayout(const std::list<std::string> & src, const std::string dest, const MP4WriteOptions *options, MP4Layout *layout);
 
 #ifdef __cplusplus
 }
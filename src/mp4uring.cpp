@@ -0,0 +1,230 @@
+#include "mp4uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+// IORING_OP_READ is an enum, IORING_FEAT_CUR_PERSONALITY came with it (5.6)
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(IORING_FEAT_CUR_PERSONALITY)
+#define HAVE_IO_URING 1
+#endif
+
+using namespace std;
+
+IOUring::IOUring()
+    : mFD(-1)
+    , mSqRing(MAP_FAILED)
+    , mSqRingSize(0)
+    , mCqRing(MAP_FAILED)
+    , mCqRingSize(0)
+    , mSqes(MAP_FAILED)
+    , mSqesSize(0)
+    , mSqHead(NULL)
+    , mSqTail(NULL)
+    , mSqMask(0)
+    , mSqEntries(0)
+    , mSqArray(NULL)
+    , mSqLocalTail(0)
+    , mCqHead(NULL)
+    , mCqTail(NULL)
+    , mCqMask(0)
+    , mCqes(NULL)
+    , mFixedFiles(false)
+    , mFixedBuffers(false)
+{}
+
+IOUring::~IOUring()
+{
+    if (mSqes != MAP_FAILED) {
+        munmap(mSqes, mSqesSize);
+    }
+    if (mCqRing != MAP_FAILED && mCqRing != mSqRing) {
+        munmap(mCqRing, mCqRingSize);
+    }
+    if (mSqRing != MAP_FAILED) {
+        munmap(mSqRing, mSqRingSize);
+    }
+    if (mFD >= 0) {
+        ::close(mFD);
+    }
+}
+
+bool
+IOUring::init(unsigned entries)
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    mFD = syscall(__NR_io_uring_setup, entries, &p);
+    if (mFD < 0) {
+        return false;
+    }
+
+    mSqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    mCqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        mSqRingSize = mCqRingSize = max(mSqRingSize, mCqRingSize);
+    }
+
+    mSqRing = mmap(NULL, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFD, IORING_OFF_SQ_RING);
+    if (mSqRing == MAP_FAILED) {
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        mCqRing = mSqRing;
+    }
+    else {
+        mCqRing = mmap(NULL, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFD, IORING_OFF_CQ_RING);
+        if (mCqRing == MAP_FAILED) {
+            return false;
+        }
+    }
+    mSqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    mSqes = mmap(NULL, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFD, IORING_OFF_SQES);
+    if (mSqes == MAP_FAILED) {
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *)mSqRing;
+    mSqHead = (unsigned *)(sq + p.sq_off.head);
+    mSqTail = (unsigned *)(sq + p.sq_off.tail);
+    mSqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    mSqEntries = p.sq_entries;
+    mSqArray = (unsigned *)(sq + p.sq_off.array);
+    mSqLocalTail = *mSqTail;
+
+    uint8_t *cq = (uint8_t *)mCqRing;
+    mCqHead = (unsigned *)(cq + p.cq_off.head);
+    mCqTail = (unsigned *)(cq + p.cq_off.tail);
+    mCqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    mCqes = cq + p.cq_off.cqes;
+
+    return true;
+#else
+    (void)entries;
+    return false;
+#endif
+}
+
+void
+IOUring::registerFiles(const int *fds, unsigned count)
+{
+    mFiles.assign(fds, fds + count);
+#ifdef HAVE_IO_URING
+    mFixedFiles = syscall(__NR_io_uring_register, mFD, IORING_REGISTER_FILES, fds, count) == 0;
+#endif
+}
+
+void
+IOUring::registerBuffers(const struct iovec *iov, unsigned count)
+{
+#ifdef HAVE_IO_URING
+    // may hit RLIMIT_MEMLOCK on older kernels, plain reads and writes then
+    mFixedBuffers = syscall(__NR_io_uring_register, mFD, IORING_REGISTER_BUFFERS, iov, count) == 0;
+#else
+    (void)iov;
+    (void)count;
+#endif
+}
+
+bool
+IOUring::prep(uint8_t opcode, uint8_t fixedOpcode, unsigned file, const void *buf, unsigned len, off_t offset, unsigned buffer, uint64_t userData)
+{
+#ifdef HAVE_IO_URING
+    unsigned head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+    if (mSqLocalTail - head >= mSqEntries || file >= mFiles.size()) {
+        return false;
+    }
+
+    unsigned index = mSqLocalTail & mSqMask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)mSqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = mFixedBuffers ? fixedOpcode : opcode;
+    sqe->fd = mFixedFiles ? (int)file : mFiles[file];
+    sqe->flags = mFixedFiles ? IOSQE_FIXED_FILE : 0;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->buf_index = mFixedBuffers ? buffer : 0;
+    sqe->user_data = userData;
+
+    mSqArray[index] = index;
+    ++mSqLocalTail;
+    return true;
+#else
+    (void)opcode; (void)fixedOpcode; (void)file; (void)buf; (void)len;
+    (void)offset; (void)buffer; (void)userData;
+    return false;
+#endif
+}
+
+bool
+IOUring::prepRead(unsigned file, void *buf, unsigned len, off_t offset, unsigned buffer, uint64_t userData)
+{
+#ifdef HAVE_IO_URING
+    return prep(IORING_OP_READ, IORING_OP_READ_FIXED, file, buf, len, offset, buffer, userData);
+#else
+    return prep(0, 0, file, buf, len, offset, buffer, userData);
+#endif
+}
+
+bool
+IOUring::prepWrite(unsigned file, const void *buf, unsigned len, off_t offset, unsigned buffer, uint64_t userData)
+{
+#ifdef HAVE_IO_URING
+    return prep(IORING_OP_WRITE, IORING_OP_WRITE_FIXED, file, buf, len, offset, buffer, userData);
+#else
+    return prep(0, 0, file, buf, len, offset, buffer, userData);
+#endif
+}
+
+int
+IOUring::submit(unsigned waitFor)
+{
+#ifdef HAVE_IO_URING
+    __atomic_store_n(mSqTail, mSqLocalTail, __ATOMIC_RELEASE);
+
+    for (;;) {
+        // everything the kernel has not consumed yet, including what an
+        // earlier partial or interrupted enter left behind
+        unsigned toSubmit = mSqLocalTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+        int ret = syscall(__NR_io_uring_enter, mFD, toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        return ret < 0 ? -errno : ret;
+    }
+#else
+    (void)waitFor;
+    return -ENOSYS;
+#endif
+}
+
+bool
+IOUring::popCompletion(uint64_t *userData, int32_t *res)
+{
+#ifdef HAVE_IO_URING
+    unsigned head = *mCqHead;
+    if (head == __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    const struct io_uring_cqe *cqe = (const struct io_uring_cqe *)mCqes + (head & mCqMask);
+    *userData = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(mCqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+#else
+    (void)userData;
+    (void)res;
+    return false;
+#endif
+}
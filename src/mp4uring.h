@@ -0,0 +1,70 @@
+#ifndef MP4_URING_H
+#define MP4_URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+/*
+ * A bare io_uring on top of the raw syscalls, so there is no liburing to
+ * link. init() fails where the kernel (or the platform) has no io_uring
+ * and callers keep to their synchronous path.
+ *
+ * Files and buffers are registered when the kernel lets us; file and
+ * buffer arguments below are indices into what was passed to
+ * registerFiles()/registerBuffers() either way, so a refused registration
+ * only costs the per-request lookups it would have saved.
+ */
+class IOUring
+{
+public:
+    IOUring();
+    ~IOUring();
+
+    bool init(unsigned entries);
+
+    void registerFiles(const int *fds, unsigned count);
+    void registerBuffers(const struct iovec *iov, unsigned count);
+
+    // false when the submission queue is full
+    bool prepRead(unsigned file, void *buf, unsigned len, off_t offset, unsigned buffer, uint64_t userData);
+    bool prepWrite(unsigned file, const void *buf, unsigned len, off_t offset, unsigned buffer, uint64_t userData);
+
+    // submit what was prepared and wait for at least waitFor completions
+    int submit(unsigned waitFor);
+
+    // res is what the syscall would have returned, or -errno
+    bool popCompletion(uint64_t *userData, int32_t *res);
+
+private:
+    bool prep(uint8_t opcode, uint8_t fixedOpcode, unsigned file, const void *buf, unsigned len, off_t offset, unsigned buffer, uint64_t userData);
+
+    int mFD;
+
+    void *mSqRing;
+    size_t mSqRingSize;
+    void *mCqRing;
+    size_t mCqRingSize;
+    void *mSqes;
+    size_t mSqesSize;
+
+    unsigned *mSqHead;
+    unsigned *mSqTail;
+    unsigned mSqMask;
+    unsigned mSqEntries;
+    unsigned *mSqArray;
+    unsigned mSqLocalTail;
+
+    unsigned *mCqHead;
+    unsigned *mCqTail;
+    unsigned mCqMask;
+    void *mCqes;
+
+    std::vector<int> mFiles;
+    bool mFixedFiles;
+    bool mFixedBuffers;
+};
+
+#endif // MP4_URING_H